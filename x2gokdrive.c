@@ -43,6 +43,7 @@
 
 #include "inputstr.h"
 #include "scrnintstr.h"
+#include "propertyst.h"
 #include "x2gokdrivelog.h"
 
 #include "xkbsrv.h"
@@ -364,8 +365,20 @@ ephyrScreenBlockHandler(ScreenPtr pScreen, void *timeout
     scrpriv->BlockHandler = pScreen->BlockHandler;
     pScreen->BlockHandler = ephyrScreenBlockHandler;
 
+    //send changes of rootless windows which were reported by window hooks
+    remote_check_rootless_windows_for_updates(screen);
+    //close disconnected viewers and resync caches for viewers waiting to join
+    remote_check_viewers();
+
     if (scrpriv->pDamage)
-        ephyrInternalDamageRedisplay(pScreen);
+    {
+        //client is not reading fast enough, keep collecting damage and try again later,
+        //but don't delay the feedback on key press or click
+        if (remote_output_congested() && !remote_input_boost_active())
+            AdjustWaitForDelay(timeout, OUTBUF_RETRY_DELAY);
+        else
+            ephyrInternalDamageRedisplay(pScreen);
+    }
 
 }
 
@@ -911,6 +924,148 @@ ephyrInitScreen(ScreenPtr pScreen)
 }
 
 
+/*
+ * window hooks, they are reporting changed windows, so in rootless mode
+ * we don't need to check the whole windows tree on every update
+ */
+static Bool
+ephyrRealizeWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+    Bool ret;
+
+    pScreen->RealizeWindow = scrpriv->RealizeWindow;
+    ret = (*pScreen->RealizeWindow)(pWin);
+    scrpriv->RealizeWindow = pScreen->RealizeWindow;
+    pScreen->RealizeWindow = ephyrRealizeWindow;
+
+    remote_window_changed(pWin);
+    remote_window_children_changed(pWin->parent);
+    return ret;
+}
+
+static Bool
+ephyrUnrealizeWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+    Bool ret;
+
+    pScreen->UnrealizeWindow = scrpriv->UnrealizeWindow;
+    ret = (*pScreen->UnrealizeWindow)(pWin);
+    scrpriv->UnrealizeWindow = pScreen->UnrealizeWindow;
+    pScreen->UnrealizeWindow = ephyrUnrealizeWindow;
+
+    remote_window_changed(pWin);
+    remote_window_children_changed(pWin->parent);
+    return ret;
+}
+
+static Bool
+ephyrPositionWindow(WindowPtr pWin, int x, int y)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+    Bool ret;
+
+    pScreen->PositionWindow = scrpriv->PositionWindow;
+    ret = (*pScreen->PositionWindow)(pWin, x, y);
+    scrpriv->PositionWindow = pScreen->PositionWindow;
+    pScreen->PositionWindow = ephyrPositionWindow;
+
+    remote_window_changed(pWin);
+    return ret;
+}
+
+static void
+ephyrRestackWindow(WindowPtr pWin, WindowPtr pOldNextSib)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    pScreen->RestackWindow = scrpriv->RestackWindow;
+    if (pScreen->RestackWindow)
+        (*pScreen->RestackWindow)(pWin, pOldNextSib);
+    scrpriv->RestackWindow = pScreen->RestackWindow;
+    pScreen->RestackWindow = ephyrRestackWindow;
+
+    remote_window_children_changed(pWin->parent);
+}
+
+static void
+ephyrReparentWindow(WindowPtr pWin, WindowPtr pPriorParent)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    pScreen->ReparentWindow = scrpriv->ReparentWindow;
+    if (pScreen->ReparentWindow)
+        (*pScreen->ReparentWindow)(pWin, pPriorParent);
+    scrpriv->ReparentWindow = pScreen->ReparentWindow;
+    pScreen->ReparentWindow = ephyrReparentWindow;
+
+    remote_window_changed(pWin);
+    remote_window_children_changed(pWin->parent);
+    remote_window_children_changed(pPriorParent);
+}
+
+static void
+ephyrClipNotify(WindowPtr pWin, int dx, int dy)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    pScreen->ClipNotify = scrpriv->ClipNotify;
+    if (pScreen->ClipNotify)
+        (*pScreen->ClipNotify)(pWin, dx, dy);
+    scrpriv->ClipNotify = pScreen->ClipNotify;
+    pScreen->ClipNotify = ephyrClipNotify;
+
+    //visibility of window can be changed
+    remote_window_changed(pWin);
+}
+
+static Bool
+ephyrDestroyWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+    Bool ret;
+
+    remote_window_destroyed(pWin);
+
+    pScreen->DestroyWindow = scrpriv->DestroyWindow;
+    ret = (*pScreen->DestroyWindow)(pWin);
+    scrpriv->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = ephyrDestroyWindow;
+
+    return ret;
+}
+
+static void
+ephyrPropertyStateCallback(CallbackListPtr *pcbl, void *closure, void *calldata)
+{
+    PropertyStateRec *rec = (PropertyStateRec *) calldata;
+
+    //name, icon, type or hints of window can be changed
+    remote_window_changed(rec->win);
+}
+
 Bool
 ephyrFinishInitScreen(ScreenPtr pScreen)
 {
@@ -932,6 +1087,23 @@ ephyrFinishInitScreen(ScreenPtr pScreen)
     scrpriv->BlockHandler = pScreen->BlockHandler;
     pScreen->BlockHandler = ephyrScreenBlockHandler;
 
+    scrpriv->RealizeWindow = pScreen->RealizeWindow;
+    pScreen->RealizeWindow = ephyrRealizeWindow;
+    scrpriv->UnrealizeWindow = pScreen->UnrealizeWindow;
+    pScreen->UnrealizeWindow = ephyrUnrealizeWindow;
+    scrpriv->PositionWindow = pScreen->PositionWindow;
+    pScreen->PositionWindow = ephyrPositionWindow;
+    scrpriv->RestackWindow = pScreen->RestackWindow;
+    pScreen->RestackWindow = ephyrRestackWindow;
+    scrpriv->ReparentWindow = pScreen->ReparentWindow;
+    pScreen->ReparentWindow = ephyrReparentWindow;
+    scrpriv->ClipNotify = pScreen->ClipNotify;
+    pScreen->ClipNotify = ephyrClipNotify;
+    scrpriv->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = ephyrDestroyWindow;
+    if (!AddCallback(&PropertyStateCallback, ephyrPropertyStateCallback, NULL))
+        return FALSE;
+
     return TRUE;
 }
 
@@ -81,6 +81,14 @@ typedef struct _ephyrScrPriv {
     unsigned long cmap[256];
 
     ScreenBlockHandlerProcPtr   BlockHandler;
+    //wrapped window functions, used to find changed windows in rootless mode
+    RealizeWindowProcPtr        RealizeWindow;
+    UnrealizeWindowProcPtr      UnrealizeWindow;
+    PositionWindowProcPtr       PositionWindow;
+    RestackWindowProcPtr        RestackWindow;
+    ReparentWindowProcPtr       ReparentWindow;
+    ClipNotifyProcPtr           ClipNotify;
+    DestroyWindowProcPtr        DestroyWindow;
 
 } EphyrScrPriv;
 
@@ -40,6 +40,7 @@
 #include "inputstr.h"
 #include <zlib.h>
 #include <propertyst.h>
+#include "servermd.h"
 
 static H264EncoderData* encoder_data;
 // static FILE *fp_bgra;
@@ -207,34 +208,167 @@ int queue_elements(void)
     return elems;
 }
 
+/* warning! cursor_mutex should be locked by thread calling this function! */
 static
-BOOL isCursorSent(uint32_t serialNumber)
+struct sentCursor* findSentCursor(uint32_t serialNumber)
 {
-    struct sentCursor* current=remoteVars.sentCursorsHead;
+    struct sentCursor* current=remoteVars.sentCursorHash[serialNumber & (CURSORHASHSIZE-1)];
     while(current)
     {
         if(current->serialNumber == serialNumber)
-            return TRUE;
+            return current;
         current=current->next;
     }
-    return FALSE;
+    return NULL;
 }
 
+/* warning! cursor_mutex should be locked by thread calling this function! */
 static
-void addSentCursor(uint32_t serialNumber)
+void addSentCursor(uint32_t serialNumber, struct cursorEntry* entry)
 {
-//    #warning check memory
     struct sentCursor* curs=malloc(sizeof(struct sentCursor));
-    curs->next=0;
+    uint32_t i=serialNumber & (CURSORHASHSIZE-1);
     curs->serialNumber=serialNumber;
-    if(!remoteVars.sentCursorsTail)
+    curs->entry=entry;
+    curs->next=remoteVars.sentCursorHash[i];
+    remoteVars.sentCursorHash[i]=curs;
+    ++entry->refs;
+}
+
+static
+void cursorImage(CursorPtr cursor, struct cursorEntry* entry)
+{
+    //fill the key of cursor image, bits are pointing to X cursor data and are not copied
+    entry->width=cursor->bits->width;
+    entry->height=cursor->bits->height;
+    entry->xhot=cursor->bits->xhot;
+    entry->yhot=cursor->bits->yhot;
+    entry->argb=(cursor->bits->argb != NULL);
+    if(entry->argb)
+    {
+        entry->bits=(char*)cursor->bits->argb;
+        entry->bitsSize=entry->width*entry->height*4;
+        memset(entry->colors, 0, sizeof(entry->colors));
+    }
+    else
+    {
+        //core cursor has source and mask bitmaps of the same size, mask is compared after source
+        entry->bits=(char*)cursor->bits->source;
+        entry->bitsSize=BitmapBytePad(entry->width)*entry->height;
+        entry->colors[0]=cursor->foreRed>>8;
+        entry->colors[1]=cursor->foreGreen>>8;
+        entry->colors[2]=cursor->foreBlue>>8;
+        entry->colors[3]=cursor->backRed>>8;
+        entry->colors[4]=cursor->backGreen>>8;
+        entry->colors[5]=cursor->backBlue>>8;
+    }
+    entry->hash=crc32(crc32(0L, Z_NULL, 0), (unsigned char*)entry->bits, entry->bitsSize);
+    if(!entry->argb)
+        entry->hash=crc32(entry->hash, (unsigned char*)cursor->bits->mask, entry->bitsSize);
+    entry->hash=crc32(entry->hash, entry->colors, sizeof(entry->colors));
+    entry->hash^=(entry->width<<16 | entry->height) ^ (entry->xhot<<16 | entry->yhot);
+}
+
+/* warning! cursor_mutex should be locked by thread calling this function! */
+static
+struct cursorEntry* findCursorEntry(struct cursorEntry* key, CursorPtr cursor)
+{
+    struct cursorEntry* current=remoteVars.cursorHash[key->hash & (CURSORHASHSIZE-1)];
+    while(current)
+    {
+        if(current->hash == key->hash && current->argb == key->argb && current->width == key->width && current->height == key->height &&
+           current->xhot == key->xhot && current->yhot == key->yhot && !memcmp(current->colors, key->colors, sizeof(key->colors)) &&
+           !memcmp(current->bits, key->bits, key->bitsSize) &&
+           (key->argb || !memcmp(current->bits + key->bitsSize, cursor->bits->mask, key->bitsSize)))
+        {
+            return current;
+        }
+        current=current->hashNext;
+    }
+    return NULL;
+}
+
+/* warning! cursor_mutex should be locked by thread calling this function! */
+static
+struct cursorEntry* addCursorEntry(struct cursorEntry* key, CursorPtr cursor)
+{
+    //store cursor image, core cursors are stored with mask after source
+    struct cursorEntry* entry=malloc(sizeof(struct cursorEntry));
+    uint32_t i=key->hash & (CURSORHASHSIZE-1);
+
+    *entry=*key;
+    entry->id=cursor->serialNumber;
+    entry->refs=0;
+    entry->released=FALSE;
+    entry->releasedNext=NULL;
+    entry->bits=malloc(key->argb?key->bitsSize:key->bitsSize*2);
+    memcpy(entry->bits, key->bits, key->bitsSize);
+    if(!key->argb)
+        memcpy(entry->bits+key->bitsSize, cursor->bits->mask, key->bitsSize);
+    entry->hashNext=remoteVars.cursorHash[i];
+    remoteVars.cursorHash[i]=entry;
+    return entry;
+}
+
+/* warning! cursor_mutex should be locked by thread calling this function! */
+static
+void deleteCursorEntry(struct cursorEntry* entry)
+{
+    //remove cursor image from hash and add it to the list of cursors which client should delete
+    struct cursorEntry** prev=&remoteVars.cursorHash[entry->hash & (CURSORHASHSIZE-1)];
+    struct deletedCursor* dcur;
+
+    while(*prev && *prev != entry)
+        prev=&((*prev)->hashNext);
+    if(*prev)
+        *prev=entry->hashNext;
+
+    dcur=malloc(sizeof(struct deletedCursor));
+    dcur->serialNumber=entry->id;
+    dcur->next=0;
+    if(remoteVars.last_deleted_cursor)
     {
-        remoteVars.sentCursorsTail=remoteVars.sentCursorsHead=curs;
+        remoteVars.last_deleted_cursor->next=dcur;
+        remoteVars.last_deleted_cursor=dcur;
     }
     else
     {
-        remoteVars.sentCursorsTail->next=curs;
-        remoteVars.sentCursorsTail=curs;
+        remoteVars.first_deleted_cursor=remoteVars.last_deleted_cursor=dcur;
+    }
+    ++remoteVars.deletedcursor_list_size;
+
+    free(entry->bits);
+    free(entry);
+}
+
+/* warning! cursor_mutex should be locked by thread calling this function! */
+static
+void purgeReleasedCursors(void)
+{
+    //delete cursor images which are not used for CURSOR_RELEASE_TIME or if there are too many of them
+    //images which are used again are only removed from the list
+    struct cursorEntry** prev=&remoteVars.firstReleasedCursor;
+    struct cursorEntry* entry;
+    uint32_t now=MyGetTickCount();
+
+    while((entry=*prev))
+    {
+        if(entry->refs)
+        {
+            entry->released=FALSE;
+            *prev=entry->releasedNext;
+            --remoteVars.releasedCursors;
+        }
+        else if(now - entry->releaseTime >= CURSOR_RELEASE_TIME || remoteVars.releasedCursors > CURSOR_RELEASED_MAX)
+        {
+            *prev=entry->releasedNext;
+            --remoteVars.releasedCursors;
+            deleteCursorEntry(entry);
+        }
+        else
+        {
+            prev=&entry->releasedNext;
+        }
     }
 }
 
@@ -252,19 +386,39 @@ void addCursorToQueue(struct cursorFrame* cframe)
     }
 }
 
+/* warning! cursor_mutex should be locked by thread calling this function! */
 static
 void freeCursors(void)
 {
     struct sentCursor* cur = NULL;
+    struct cursorEntry* entry = NULL;
     struct cursorFrame* curf = NULL;
+    struct deletedCursor* dcur = NULL;
+    int i;
 
-    cur=remoteVars.sentCursorsHead;
-    while(cur)
+    for(i=0;i<CURSORHASHSIZE;++i)
     {
-        struct sentCursor* next=cur->next;
-        free(cur);
-        cur=next;
+        cur=remoteVars.sentCursorHash[i];
+        while(cur)
+        {
+            struct sentCursor* next=cur->next;
+            free(cur);
+            cur=next;
+        }
+        remoteVars.sentCursorHash[i]=0;
+
+        entry=remoteVars.cursorHash[i];
+        while(entry)
+        {
+            struct cursorEntry* next=entry->hashNext;
+            free(entry->bits);
+            free(entry);
+            entry=next;
+        }
+        remoteVars.cursorHash[i]=0;
     }
+    remoteVars.firstReleasedCursor=0;
+    remoteVars.releasedCursors=0;
 
     curf=remoteVars.firstCursor;
     while(curf)
@@ -275,56 +429,63 @@ void freeCursors(void)
         free(curf);
         curf=next;
     }
-    remoteVars.sentCursorsHead=remoteVars.sentCursorsTail=0;
+
+    dcur=remoteVars.first_deleted_cursor;
+    while(dcur)
+    {
+        struct deletedCursor* next=dcur->next;
+        free(dcur);
+        dcur=next;
+    }
     remoteVars.firstCursor=remoteVars.lastCursor=0;
+    remoteVars.first_deleted_cursor=remoteVars.last_deleted_cursor=0;
+    remoteVars.deletedcursor_list_size=0;
 }
 
 void remote_removeCursor(uint32_t serialNumber)
 {
+    struct sentCursor** prev = NULL;
     struct sentCursor* cur = NULL;
-    struct sentCursor* prev = NULL;
-    struct deletedCursor* dcur = NULL;
+    struct cursorEntry* entry = NULL;
 
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
+    prev=&remoteVars.sentCursorHash[serialNumber & (CURSORHASHSIZE-1)];
 
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-    cur=remoteVars.sentCursorsHead;
-
-    while(cur)
+    while((cur=*prev))
     {
         if(cur->serialNumber==serialNumber)
         {
-            if(prev)
-                prev->next=cur->next;
-            if(cur==remoteVars.sentCursorsHead)
-                remoteVars.sentCursorsHead=cur->next;
-            if(cur==remoteVars.sentCursorsTail)
-                remoteVars.sentCursorsTail=prev;
+            *prev=cur->next;
+            entry=cur->entry;
             free(cur);
             break;
         }
-        prev=cur;
-        cur=cur->next;
-    }
-    dcur=malloc(sizeof(struct deletedCursor));
-    dcur->serialNumber=serialNumber;
-    dcur->next=0;
-    if(remoteVars.last_deleted_cursor)
-    {
-        remoteVars.last_deleted_cursor->next=dcur;
-        remoteVars.last_deleted_cursor=dcur;
+        prev=&cur->next;
     }
-    else
+    //client has the image till no X cursors are using it
+    //it's deleted on client later, applications often create the same cursor again
+    if(entry && !--entry->refs)
     {
-        remoteVars.first_deleted_cursor=remoteVars.last_deleted_cursor=dcur;
+        entry->releaseTime=MyGetTickCount();
+        if(!entry->released)
+        {
+            entry->released=TRUE;
+            entry->releasedNext=remoteVars.firstReleasedCursor;
+            remoteVars.firstReleasedCursor=entry;
+            ++remoteVars.releasedCursors;
+        }
     }
-    ++remoteVars.deletedcursor_list_size;
+    purgeReleasedCursors();
 
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
 }
 
 void remote_sendCursor(CursorPtr cursor)
 {
     BOOL cursorSent=FALSE;
+    struct sentCursor* sent;
+    struct cursorEntry key;
+    struct cursorEntry* entry;
 //    #warning check memory
     struct cursorFrame* cframe=malloc(sizeof(struct cursorFrame));
     bzero(cframe, sizeof(struct cursorFrame));
@@ -332,10 +493,30 @@ void remote_sendCursor(CursorPtr cursor)
     cframe->serialNumber=cursor->serialNumber;
 
 
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-    cursorSent=isCursorSent(cursor->serialNumber);
-
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
+    sent=findSentCursor(cursor->serialNumber);
+    if(sent)
+    {
+        cursorSent=TRUE;
+        cframe->serialNumber=sent->entry->id;
+    }
+    else
+    {
+        //if other cursor with the same image was sent, client is using it by id of that cursor
+        cursorImage(cursor, &key);
+        entry=findCursorEntry(&key, cursor);
+        if(entry)
+        {
+            cursorSent=TRUE;
+            cframe->serialNumber=entry->id;
+        }
+        else
+        {
+            entry=addCursorEntry(&key, cursor);
+        }
+        addSentCursor(cursor->serialNumber, entry);
+    }
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
     if(!cursorSent)
     {
         if(cursor->bits->argb)
@@ -377,19 +558,13 @@ void remote_sendCursor(CursorPtr cursor)
         cframe->forR=cursor->foreRed*255./65535.0;
         cframe->forG=cursor->foreGreen*255./65535.0;
         cframe->forB=cursor->foreBlue*255./65535.0;
-
-
-        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-        addSentCursor(cursor->serialNumber);
-
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
     }
 
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
     addCursorToQueue(cframe);
-    pthread_cond_signal(&remoteVars.have_sendqueue_cond);
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
 
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    remote_wakeup_send_thread();
 }
 
 
@@ -422,9 +597,8 @@ int32_t send_cursor(struct cursorFrame* cursor)
 {
     unsigned char* buffer;
     unsigned char static_buffer[64]={0};
-    _X_UNUSED int ln = 0;
-    int l = 0;
-    int sent = 0;
+    struct iovec iov[2];
+    ssize_t l = 0;
 
     buffer=static_buffer;
 
@@ -448,36 +622,39 @@ int32_t send_cursor(struct cursorFrame* cursor)
 
 //     EPHYR_DBG("SENDING CURSOR %d with size %d", cursor->serialNumber, cursor->size);
 
-//    #warning check this
-    ln=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
-
-    while(sent<cursor->size)
+    //send header and cursor data with one syscall
+    iov[0].iov_base=buffer;
+    iov[0].iov_len=56;
+    iov[1].iov_base=cursor->data;
+    iov[1].iov_len=cursor->size;
+    l=remote_writev_socket(remoteVars.clientsock_tcp, iov, 2);
+    if(l<0)
     {
-        l=remote_write_socket(remoteVars.clientsock_tcp, cursor->data+sent,((cursor->size-sent)<MAXMSGSIZE)?(cursor->size-sent):MAXMSGSIZE);
-        if(l<0)
-        {
-            EPHYR_DBG("Error sending cursor!!!!!");
-            break;
-        }
-        sent+=l;
+        EPHYR_DBG("Error sending cursor!!!!!");
+        return 0;
     }
     // remoteVars.data_sent+=sent;
 //    EPHYR_DBG("SENT total %d", total);
 
-    return sent;
+    return l-56;
 }
 
 static
 int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uint32_t crc, struct frame_region* regions, uint32_t winId)
 {
     unsigned char buffer[64] = {0};
+    //headers of regions for TCP connection
+    unsigned char region_buffers[9][64] = {{0}};
+    //frame header + header and data of every region
+    struct iovec iov[1+9*2];
+    int iovcnt=0;
     unsigned char* head_buffer=buffer;
     unsigned char* data=0;
     unsigned int header_size=8*4;
     unsigned int region_header_size=8*4;
-    _X_UNUSED int ln = 0;
-    int l = 0;
-    int sent = 0;
+    ssize_t l = 0;
+    //clients supporting latency measurement are getting id of input in frame header
+    BOOL sendInputId=(remoteVars.client_version>=12);
     int i;
     //number of datagrams
 
@@ -494,13 +671,15 @@ int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uin
     if(remoteVars.send_frames_over_udp)
     {
         //frame header size
+        if(sendInputId)
+            header_size+=4;
         total=header_size;
         for(i=0;i<9;++i)
         {
             if(!(regions[i].rect.size.width && regions[i].rect.size.height))
                 continue;
             //region header size
-            total+=header_size;
+            total+=region_header_size;
             total+=regions[i].size;
         }
 //         EPHYR_DBG("Sending frame, total size %d", total);
@@ -524,10 +703,15 @@ int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uin
             EPHYR_DBG("Sending frame for Window 0x%X",winId);
         }*/
     }
+    if(sendInputId)
+    {
+        *((uint32_t*)head_buffer+8)=remoteVars.frameInputId;
+    }
 
     if(!remoteVars.send_frames_over_udp)
     {
-        ln=remote_write_socket(remoteVars.clientsock_tcp, buffer,56);
+        iov[iovcnt].iov_base=buffer;
+        iov[iovcnt++].iov_len=56;
     }
     else
     {
@@ -538,6 +722,11 @@ int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uin
     {
         if(!(regions[i].rect.size.width && regions[i].rect.size.height))
             continue;
+        if(!remoteVars.send_frames_over_udp)
+        {
+            //every region has it's own header in TCP connection, all of them are sent with one call
+            head_buffer=region_buffers[i];
+        }
         //        EPHYR_DBG("SENDING FRAME REGION %x %dx%d %d",regions[i].source_crc, regions[i].rect.size.width, regions[i].rect.size.height,
         //                  regions[i].size);
         *((uint32_t*)head_buffer)=regions[i].source_crc;
@@ -563,31 +752,28 @@ int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uin
         }
         else
         {
-            sent = 0;
-            //        #warning check this
-            ln=remote_write_socket(remoteVars.clientsock_tcp, buffer, 64);
-
-            while(sent<regions[i].size)
-            {
-                l=remote_write_socket(remoteVars.clientsock_tcp,regions[i].compressed_data+sent,
-                        ((regions[i].size-sent)<MAXMSGSIZE)?(regions[i].size-sent):MAXMSGSIZE);
-                if(l<0)
-                {
-                    EPHYR_DBG("Error sending file!!!!!");
-                    break;
-                }
-                sent+=l;
-            }
-            total+=sent;
-            //        EPHYR_DBG("SENT %d",sent);
-            //
-            //        EPHYR_DBG("\ncache elements %d, cache size %lu(%dMB), connection time=%d, sent %lu(%dMB)\n",
-            //                  cache_elements, cache_size, (int) (cache_size/1024/1024),
-            //                  time(NULL)-con_start_time, data_sent, (int) (data_sent/1024/1024));
+            iov[iovcnt].iov_base=head_buffer;
+            iov[iovcnt++].iov_len=64;
+            iov[iovcnt].iov_base=regions[i].compressed_data;
+            iov[iovcnt++].iov_len=regions[i].size;
+            total+=regions[i].size;
         }
     }
-    //if proto TCP all data is sent at this moment
-    if(remoteVars.send_frames_over_udp)
+    if(!remoteVars.send_frames_over_udp)
+    {
+        //send frame header, region headers and data with one syscall
+        l=remote_writev_socket(remoteVars.clientsock_tcp, iov, iovcnt);
+        if(l<0)
+        {
+            EPHYR_DBG("Error sending file!!!!!");
+        }
+        //        EPHYR_DBG("SENT %d",total);
+        //
+        //        EPHYR_DBG("\ncache elements %d, cache size %lu(%dMB), connection time=%d, sent %lu(%dMB)\n",
+        //                  cache_elements, cache_size, (int) (cache_size/1024/1024),
+        //                  time(NULL)-con_start_time, data_sent, (int) (data_sent/1024/1024));
+    }
+    else
     {
         if(remoteVars.compression==JPEG)
         {
@@ -608,20 +794,30 @@ int32_t send_frame(u_int32_t width, uint32_t height, uint32_t x, uint32_t y, uin
     return total;
 }
 
+/*
+ * takes the list of deleted elements under cache_mutex and sends it to client.
+ * Should be called without locked mutexes
+ */
 static
 int send_deleted_elements(void)
 {
     unsigned char* buffer;
     unsigned char static_buffer[56] = {0};
     unsigned char* list = NULL;
+    struct iovec iov[2];
 
-    _X_UNUSED int ln = 0;
-    int l = 0;
+    int ln = 0;
     int length, sent = 0;
 
     unsigned int i = 0;
     struct deleted_elem* elem = NULL;
 
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    if(!remoteVars.first_deleted_elements)
+    {
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
+        return 0;
+    }
     length=remoteVars.deleted_list_size*sizeof(uint32_t);
     buffer=static_buffer;
 
@@ -643,38 +839,52 @@ int send_deleted_elements(void)
     }
 
     remoteVars.last_deleted_elements=0l;
+    remoteVars.deleted_list_size=0;
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
 
     //    EPHYR_DBG("SENDING IMG length - %d, number - %d\n",length,framenum_sent++);
-    ln=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
-    while(sent<length)
+    //header and data are added to output buffer as one message
+    iov[0].iov_base=buffer;
+    iov[0].iov_len=56;
+    iov[1].iov_base=list;
+    iov[1].iov_len=length;
+    ln=remote_writev_socket(remoteVars.clientsock_tcp, iov, 2);
+    if(ln<0)
     {
-        l=remote_write_socket(remoteVars.clientsock_tcp,list+sent,((length-sent)<MAXMSGSIZE)?(length-sent):MAXMSGSIZE);
-        if(l<0)
-        {
-            EPHYR_DBG("Error sending list of deleted elements!!!!!");
-            break;
-        }
-        sent+=l;
+        EPHYR_DBG("Error sending list of deleted elements!!!!!");
+    }
+    else
+    {
+        sent=length;
     }
-    remoteVars.deleted_list_size=0;
     free(list);
     return sent;
 }
 
+/*
+ * takes the list of deleted cursors under cursor_mutex and sends it to client.
+ * Should be called without locked mutexes
+ */
 static
 int send_deleted_cursors(void)
 {
     unsigned char* buffer;
     unsigned char static_buffer[56] = {0};
     unsigned char* list = NULL;
+    struct iovec iov[2];
 
-    _X_UNUSED int ln = 0;
-    int l = 0;
+    int ln = 0;
     int length, sent = 0;
 
     unsigned int i=0;
     struct deletedCursor* elem = NULL;
 
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
+    if(!remoteVars.first_deleted_cursor)
+    {
+        pthread_mutex_unlock(&remoteVars.cursor_mutex);
+        return 0;
+    }
     length=remoteVars.deletedcursor_list_size*sizeof(uint32_t);
     buffer=static_buffer;
 
@@ -697,22 +907,25 @@ int send_deleted_cursors(void)
     }
 
     remoteVars.last_deleted_cursor=0l;
+    remoteVars.deletedcursor_list_size=0;
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
 
 //    EPHYR_DBG("Sending list from %d elements", deletedcursor_list_size);
-    ln=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
-    while(sent<length)
+    //header and data are added to output buffer as one message
+    iov[0].iov_base=buffer;
+    iov[0].iov_len=56;
+    iov[1].iov_base=list;
+    iov[1].iov_len=length;
+    ln=remote_writev_socket(remoteVars.clientsock_tcp, iov, 2);
+    if(ln<0)
     {
-        l=remote_write_socket(remoteVars.clientsock_tcp,list+sent,((length-sent)<MAXMSGSIZE)?(length-sent):MAXMSGSIZE);
-        if(l<0)
-        {
-            EPHYR_DBG("Error sending list of deleted cursors!!!!!");
-            break;
-        }
-        sent+=l;
+        EPHYR_DBG("Error sending list of deleted cursors!!!!!");
+    }
+    else
+    {
+        sent=length;
     }
     free(list);
-
-    remoteVars.deletedcursor_list_size=0;
     return sent;
 }
 
@@ -751,8 +964,8 @@ int send_selection_chunk(int sel, unsigned char* data, uint32_t length, uint32_t
 
     unsigned char* buffer;
     unsigned char static_buffer[56]={0};
-    _X_UNUSED int ln = 0;
-    int l = 0;
+    struct iovec iov[2];
+    int ln = 0;
     int sent = 0;
     uint32_t uncompressed_length=length;
 
@@ -776,16 +989,19 @@ int send_selection_chunk(int sel, unsigned char* data, uint32_t length, uint32_t
 
 
 
-    ln=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
-    while(sent<length)
+    //header and data are added to output buffer as one message
+    iov[0].iov_base=buffer;
+    iov[0].iov_len=56;
+    iov[1].iov_base=data;
+    iov[1].iov_len=length;
+    ln=remote_writev_socket(remoteVars.clientsock_tcp, iov, 2);
+    if(ln<0)
     {
-        l=remote_write_socket(remoteVars.clientsock_tcp,data+sent,((length-sent)<MAXMSGSIZE)?(length-sent):MAXMSGSIZE);
-        if(l<0)
-        {
-            EPHYR_DBG("Error sending selection!!!!!");
-            break;
-        }
-        sent+=l;
+        EPHYR_DBG("Error sending selection!!!!!");
+    }
+    else
+    {
+        sent=length;
     }
     return sent;
 }
@@ -793,7 +1009,7 @@ int send_selection_chunk(int sel, unsigned char* data, uint32_t length, uint32_t
 
 
 /*
- * sendqueue_mutex should be locked when calling this function
+ * cache_mutex should be locked when calling this function
  */
 static
 struct cache_elem* find_best_match(struct cache_elem* frame, unsigned int* match_val)
@@ -1510,9 +1726,9 @@ BOOL find_common_regions(struct cache_elem* source, struct cache_elem* dest, BOO
 
 /* use only from send thread */
 static
-void sendMainImageFromSendThread(uint32_t width, uint32_t height, int32_t dx ,int32_t dy, uint32_t winId)
+uint32_t sendMainImageFromSendThread(uint32_t width, uint32_t height, int32_t dx ,int32_t dy, uint32_t winId)
 {
-    _X_UNUSED uint32_t length = 0;
+    uint32_t length = 0;
     struct frame_region regions[9] = {{0}};
 
     uint32_t isize = 0;
@@ -1572,6 +1788,9 @@ void sendMainImageFromSendThread(uint32_t width, uint32_t height, int32_t dx ,in
     regions[0].rect.lt_corner.x=dx;
     regions[0].rect.lt_corner.y=dy;
 
+    //image is compressed, don't block main thread while sending
+    pthread_mutex_unlock(&remoteVars.mainimg_mutex);
+
     if(mainImage)
     {
         send_frame(width, height,-1,-1,0,regions, winId);
@@ -1581,38 +1800,208 @@ void sendMainImageFromSendThread(uint32_t width, uint32_t height, int32_t dx ,in
         send_frame(width, height,dx,dy,0,regions, winId);
     }
 
-
-    pthread_mutex_unlock(&remoteVars.mainimg_mutex);
     free(regions[0].compressed_data);
+    return length;
 }
 
 static
 void remote_send_win_updates(char* updateBuf, uint32_t bufSize)
 {
     unsigned char buffer[56] = {0};
+    struct iovec iov[2];
     int l = 0;
-    int sent = 0;
 
     *((uint32_t*)buffer)=WINUPDATE;
     *((uint32_t*)buffer+1)=bufSize;
 
-    l=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
+    iov[0].iov_base=buffer;
+    iov[0].iov_len=56;
+    iov[1].iov_base=updateBuf;
+    iov[1].iov_len=bufSize;
+    l=remote_writev_socket(remoteVars.clientsock_tcp, iov, 2);
+    if(l<0)
+    {
+        EPHYR_DBG("Error sending windows update!!!!!");
+    }
+//     EPHYR_DBG("SENT WIN UPDATES %d",bufSize);
+    free(updateBuf);
+}
+
+/*
+ * check if client has the name or icon with this crc.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+BOOL win_cache_find(uint32_t* cache, uint32_t crc)
+{
+    int i;
+    for(i=0;i<WINCACHESIZE;++i)
+    {
+        if(cache[i] == crc)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * remember that the name or icon was sent to client, the oldest one is forgotten.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+void win_cache_add(uint32_t* cache, int* next, uint32_t crc)
+{
+    cache[*next]=crc;
+    *next=(*next+1)%WINCACHESIZE;
+}
 
-    while(sent<bufSize)
+static
+int winupd_put_varint(char* buf, uint32_t val)
+{
+    int l=0;
+    while(val >= 0x80)
     {
-        l=remote_write_socket(remoteVars.clientsock_tcp,updateBuf+sent,((bufSize-sent)<MAXMSGSIZE)?(bufSize-sent):MAXMSGSIZE);
-        if(l<0)
+        buf[l++]=(val & 0x7F) | 0x80;
+        val>>=7;
+    }
+    buf[l++]=val;
+    return l;
+}
+
+//signed difference to the last sent value, small differences are taking one byte
+static
+int winupd_put_delta(char* buf, int32_t val, int32_t sentVal)
+{
+    int32_t delta=val-sentVal;
+    return winupd_put_varint(buf, ((uint32_t)delta<<1) ^ (uint32_t)(delta>>31));
+}
+
+//find out which fields of window should be sent to client
+static
+uint16_t window_changed_fields(struct remoteWindow* rwin)
+{
+    uint16_t fields=0;
+    if(rwin->state == NEW)
+        fields=WINFIELD_ALL;
+    if(rwin->parentId != rwin->sent.parentId)
+        fields|=WINFIELD_PARENT;
+    if(rwin->nextSibId != rwin->sent.nextSibId)
+        fields|=WINFIELD_NEXTSIB;
+    if(rwin->transWinId != rwin->sent.transWinId)
+        fields|=WINFIELD_TRANSWIN;
+    if(rwin->x != rwin->sent.x)
+        fields|=WINFIELD_X;
+    if(rwin->y != rwin->sent.y)
+        fields|=WINFIELD_Y;
+    if(rwin->w != rwin->sent.w)
+        fields|=WINFIELD_W;
+    if(rwin->h != rwin->sent.h)
+        fields|=WINFIELD_H;
+    if(rwin->minw != rwin->sent.minw)
+        fields|=WINFIELD_MINW;
+    if(rwin->minh != rwin->sent.minh)
+        fields|=WINFIELD_MINH;
+    if(rwin->bw != rwin->sent.bw)
+        fields|=WINFIELD_BW;
+    if(rwin->visibility != rwin->sent.visibility)
+        fields|=WINFIELD_VISIBILITY;
+    if(rwin->winType != rwin->sent.winType)
+        fields|=WINFIELD_TYPE;
+    if(rwin->nameCrc != rwin->sent.nameCrc)
+        fields|=WINFIELD_NAME;
+    if(rwin->iconCrc != rwin->sent.iconCrc)
+        fields|=WINFIELD_ICON;
+    return fields;
+}
+
+//write changed fields of window to buffer, returns the amount of written bytes
+static
+int serialize_window_fields(struct remoteWindow* rwin, char* buf)
+{
+    int l=0;
+    uint16_t fields=rwin->updateFields;
+    int16_t nameSize=0;
+
+    memcpy(buf+l, &fields, sizeof(uint16_t));
+    l+=sizeof(uint16_t);
+    if(fields & WINFIELD_PARENT)
+        l+=winupd_put_varint(buf+l, rwin->parentId);
+    if(fields & WINFIELD_NEXTSIB)
+        l+=winupd_put_varint(buf+l, rwin->nextSibId);
+    if(fields & WINFIELD_TRANSWIN)
+        l+=winupd_put_varint(buf+l, rwin->transWinId);
+    if(fields & WINFIELD_X)
+        l+=winupd_put_delta(buf+l, rwin->x, rwin->sent.x);
+    if(fields & WINFIELD_Y)
+        l+=winupd_put_delta(buf+l, rwin->y, rwin->sent.y);
+    if(fields & WINFIELD_W)
+        l+=winupd_put_delta(buf+l, rwin->w, rwin->sent.w);
+    if(fields & WINFIELD_H)
+        l+=winupd_put_delta(buf+l, rwin->h, rwin->sent.h);
+    if(fields & WINFIELD_MINW)
+        l+=winupd_put_delta(buf+l, rwin->minw, rwin->sent.minw);
+    if(fields & WINFIELD_MINH)
+        l+=winupd_put_delta(buf+l, rwin->minh, rwin->sent.minh);
+    if(fields & WINFIELD_BW)
+        l+=winupd_put_delta(buf+l, rwin->bw, rwin->sent.bw);
+    if(fields & WINFIELD_VISIBILITY)
+        buf[l++]=rwin->visibility;
+    if(fields & WINFIELD_TYPE)
+        buf[l++]=rwin->winType;
+    if(fields & WINFIELD_NAME)
+    {
+        memcpy(buf+l, &(rwin->nameCrc), sizeof(uint32_t));
+        l+=sizeof(uint32_t);
+        if(rwin->sendName)
+        {
+            nameSize=strlen(rwin->name);
+        }
+        l+=winupd_put_varint(buf+l, nameSize);
+        memcpy(buf+l, rwin->name, nameSize);
+        l+=nameSize;
+    }
+    if(fields & WINFIELD_ICON)
+    {
+        memcpy(buf+l, &(rwin->iconCrc), sizeof(uint32_t));
+        l+=sizeof(uint32_t);
+        l+=winupd_put_varint(buf+l, (rwin->sendIcon)?rwin->icon_size:0);
+        if(rwin->sendIcon)
+        {
+            memcpy(buf+l, rwin->icon_png, rwin->icon_size);
+            l+=rwin->icon_size;
+        }
+    }
+    return l;
+}
+
+static
+unsigned int remote_window_hash(WindowPtr win)
+{
+    return (((uintptr_t)win)>>4) & (WINHASHSIZE-1);
+}
+
+/*
+ * remove window from hash table, it can't be found by pointer anymore.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+void remote_unhash_window(struct remoteWindow* rwin)
+{
+    struct remoteWindow** rw;
+    if(!rwin->ptr)
+        return;
+    rw=&(remoteVars.windowHash[remote_window_hash(rwin->ptr)]);
+    while(*rw)
+    {
+        if(*rw == rwin)
         {
-            EPHYR_DBG("Error sending windows update!!!!!");
+            *rw=rwin->hashNext;
             break;
         }
-        sent+=l;
+        rw=&((*rw)->hashNext);
     }
-//     EPHYR_DBG("SENT WIN UPDATES %d",bufSize);
-    free(updateBuf);
+    rwin->hashNext=NULL;
 }
 
-
 void remote_process_window_updates(void)
 {
     /*sendqueue mutex is locked here*/
@@ -1624,38 +2013,90 @@ void remote_process_window_updates(void)
     char* updateBuf=NULL;
     int8_t state;
     int16_t nameSize;
+    uint32_t iconSize;
     //calculate size of update buffer
     while(rwin)
     {
         if((rwin->state == CHANGED)||(rwin->state == NEW))
         {
-            bufSize+=WINUPDSIZE;
-            if(rwin->name)
+            rwin->updateFields=window_changed_fields(rwin);
+            if(remoteVars.client_version >= 15 && !rwin->updateFields)
             {
-                bufSize+=strlen(rwin->name);
+                //window was changed and changed back before we sent it, nothing to update
+                rwin->state=UNCHANGED;
             }
-            bufSize+=rwin->icon_size;
-        }
-        if(rwin->state==WDEL)
-        {
-            bufSize+=WINUPDDELSIZE;
         }
-        rwin=rwin->next;
-    }
-    //copy update data to buffer
-    updateBuf=malloc(bufSize);
-    rwin=remoteVars.windowList;
-    while(rwin)
-    {
-        if(rwin->state != UNCHANGED)
+        if((rwin->state == CHANGED)||(rwin->state == NEW))
         {
-            memcpy(updateBuf+bufHead, &(rwin->id), sizeof(uint32_t));
-            bufHead+=sizeof(uint32_t);
-            state=rwin->state;
-            memcpy(updateBuf+bufHead, &state, sizeof(state));
-            bufHead+=sizeof(state);
+            if(remoteVars.client_version >= 15)
+                bufSize+=WINUPDDELTASIZE;
+            else
+                bufSize+=WINUPDSIZE;
+            if(remoteVars.client_version >= 14)
+            {
+                if(remoteVars.client_version < 15)
+                    bufSize+=WINUPDCRCSIZE;
+                //client knows names and icons it got before, send only crc
+                rwin->sendName=(rwin->nameCrc && !win_cache_find(remoteVars.sentWinNames, rwin->nameCrc));
+                if(remoteVars.client_version >= 15 && !(rwin->updateFields & WINFIELD_NAME))
+                {
+                    rwin->sendName=FALSE;
+                }
+                if(rwin->sendName)
+                {
+                    win_cache_add(remoteVars.sentWinNames, &remoteVars.sentWinNamesNext, rwin->nameCrc);
+                }
+                //icon is kept till it's changed, it's sent again if client dropped it from it's cache
+                rwin->sendIcon=(rwin->icon_size && !win_cache_find(remoteVars.sentWinIcons, rwin->iconCrc));
+                if(remoteVars.client_version >= 15 && !(rwin->updateFields & WINFIELD_ICON))
+                {
+                    rwin->sendIcon=FALSE;
+                }
+                if(rwin->sendIcon)
+                {
+                    win_cache_add(remoteVars.sentWinIcons, &remoteVars.sentWinIconsNext, rwin->iconCrc);
+                }
+            }
+            else
+            {
+                rwin->sendName=(rwin->name != NULL);
+                //send icon data only once
+                rwin->sendIcon=(rwin->icon_size && (!rwin->known || rwin->iconCrc != rwin->sent.iconCrc));
+            }
+            if(rwin->sendName)
+            {
+                bufSize+=strlen(rwin->name);
+            }
+            if(rwin->sendIcon)
+            {
+                bufSize+=rwin->icon_size;
+            }
         }
-        if((rwin->state == CHANGED)||(rwin->state==NEW))
+        if(rwin->state==WDEL && rwin->known)
+        {
+            bufSize+=WINUPDDELSIZE;
+        }
+        rwin=rwin->next;
+    }
+    //copy update data to buffer
+    updateBuf=malloc(bufSize);
+    rwin=remoteVars.windowList;
+    while(rwin)
+    {
+        //client never got the window which is deleted now, don't tell him about it
+        if(rwin->state != UNCHANGED && (rwin->state != WDEL || rwin->known))
+        {
+            memcpy(updateBuf+bufHead, &(rwin->id), sizeof(uint32_t));
+            bufHead+=sizeof(uint32_t);
+            state=rwin->state;
+            memcpy(updateBuf+bufHead, &state, sizeof(state));
+            bufHead+=sizeof(state);
+        }
+        if(((rwin->state == CHANGED)||(rwin->state==NEW)) && remoteVars.client_version >= 15)
+        {
+            bufHead+=serialize_window_fields(rwin, updateBuf+bufHead);
+        }
+        else if((rwin->state == CHANGED)||(rwin->state==NEW))
         {
             memcpy(updateBuf+bufHead, &(rwin->parentId), sizeof(uint32_t));
             bufHead+=sizeof(uint32_t);
@@ -1684,8 +2125,13 @@ void remote_process_window_updates(void)
             bufHead+=sizeof(int8_t);
             memcpy(updateBuf+bufHead, &(rwin->winType), sizeof(int8_t));
             bufHead+=sizeof(int8_t);
+            if(remoteVars.client_version >= 14)
+            {
+                memcpy(updateBuf+bufHead, &(rwin->nameCrc), sizeof(uint32_t));
+                bufHead+=sizeof(uint32_t);
+            }
             nameSize=0;
-            if(rwin->name)
+            if(rwin->sendName)
             {
                 nameSize=strlen(rwin->name);
             }
@@ -1696,17 +2142,37 @@ void remote_process_window_updates(void)
                 memcpy(updateBuf+bufHead, rwin->name, nameSize);
                 bufHead+=nameSize;
             }
-            memcpy(updateBuf+bufHead, &(rwin->icon_size), sizeof(uint32_t));
+            if(remoteVars.client_version >= 14)
+            {
+                memcpy(updateBuf+bufHead, &(rwin->iconCrc), sizeof(uint32_t));
+                bufHead+=sizeof(uint32_t);
+            }
+            iconSize=(rwin->sendIcon)?rwin->icon_size:0;
+            memcpy(updateBuf+bufHead, &iconSize, sizeof(uint32_t));
             bufHead+=sizeof(uint32_t);
-            if(rwin->icon_size)
+            if(iconSize)
             {
                 memcpy(updateBuf+bufHead, rwin->icon_png, rwin->icon_size);
                 bufHead+=rwin->icon_size;
-                //send icon data only once
-                free(rwin->icon_png);
-                rwin->icon_png=0;
-                rwin->icon_size=0;
             }
+        }
+        if((rwin->state == CHANGED)||(rwin->state==NEW))
+        {
+            rwin->sent.parentId=rwin->parentId;
+            rwin->sent.nextSibId=rwin->nextSibId;
+            rwin->sent.transWinId=rwin->transWinId;
+            rwin->sent.x=rwin->x;
+            rwin->sent.y=rwin->y;
+            rwin->sent.w=rwin->w;
+            rwin->sent.h=rwin->h;
+            rwin->sent.minw=rwin->minw;
+            rwin->sent.minh=rwin->minh;
+            rwin->sent.bw=rwin->bw;
+            rwin->sent.visibility=rwin->visibility;
+            rwin->sent.winType=rwin->winType;
+            rwin->sent.nameCrc=rwin->nameCrc;
+            rwin->sent.iconCrc=rwin->iconCrc;
+            rwin->known=TRUE;
             rwin->state=UNCHANGED;
         }
         if(rwin->state==WDEL)
@@ -1723,6 +2189,7 @@ void remote_process_window_updates(void)
             }
             tmp=rwin;
             rwin=rwin->next;
+            remote_unhash_window(tmp);
             if(tmp->name)
             {
                 free(tmp->name);
@@ -1750,9 +2217,16 @@ void remote_process_window_updates(void)
 
     //send win updates
     remoteVars.windowsUpdated=FALSE;
+    if(!bufHead)
+    {
+        //all changes were cancelled by later changes
+        free(updateBuf);
+        return;
+    }
+    remoteVars.lastWinUpdateTime=MyGetTickCount();
     pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-    //send_updates
-    remote_send_win_updates(updateBuf, bufSize);
+    //send_updates, the buffer can be bigger than the data in it
+    remote_send_win_updates(updateBuf, bufHead);
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
 }
 
@@ -1763,6 +2237,103 @@ long MyGetTickCount() {
   return t;
 }
 
+static
+uint64_t remote_time_usec(void)
+{
+    struct timeval tim;
+    gettimeofday(&tim, NULL);
+    return (uint64_t)tim.tv_sec*1000000+tim.tv_usec;
+}
+
+/*
+ * remember input event from client. The first frame which is added after input will carry the id of input,
+ * so the client can measure input-to-display latency. Called by main thread
+ */
+void remote_input_received(uint32_t inputId)
+{
+    uint64_t now=remote_time_usec();
+    //keep the first input which didn't cause a frame yet, forget inputs which didn't change anything
+    if(remoteVars.pendingInputTime && now-remoteVars.pendingInputTime < LATENCY_INPUT_TIMEOUT*1000)
+        return;
+    remoteVars.pendingInputId=inputId;
+    remoteVars.pendingInputTime=now;
+}
+
+/*
+ * remember the time of key press or click. The damage which appears shortly after it is most likely
+ * the feedback user is waiting for. Called by main thread
+ */
+void remote_boost_input(void)
+{
+    if(remoteVars.inputBoost != BOOST_NONE)
+        remoteVars.lastBoostInputTime=remote_time_usec();
+}
+
+/*
+ * check if we are still waiting for the feedback on last key press or click. Called by main thread
+ */
+BOOL remote_input_boost_active(void)
+{
+    if(remoteVars.inputBoost == BOOST_NONE || !remoteVars.lastBoostInputTime)
+        return FALSE;
+    return (remote_time_usec()-remoteVars.lastBoostInputTime < INPUT_BOOST_TIME*1000);
+}
+
+/*
+ * add latency of stage to histogram.
+ * warning! cache_mutex should be locked by thread calling this function!
+ */
+static
+void record_latency(int stage, uint64_t start, uint64_t end)
+{
+    uint64_t msec=(end>start)?(end-start)/1000:0;
+    int bucket=0;
+
+    while(bucket < LAT_BUCKETS-1 && msec >= (1ULL<<bucket))
+        ++bucket;
+    remoteVars.latencyHist[stage][bucket]++;
+}
+
+/*
+ * write latency histograms to file, every line is a stage with counters for buckets < 1, 2, 4 ... msec.
+ * Called by send thread or by main thread for H264 without locked mutexes
+ */
+static
+void dump_latency_histograms(void)
+{
+    const char* stages[LAT_STAGES]={"damage", "encode", "queue", "send", "total"};
+    uint32_t hist[LAT_STAGES][LAT_BUCKETS];
+    FILE* ptr;
+    int i,j;
+
+    if(!strlen(remoteVars.latencyFile) || time(NULL)-remoteVars.lastLatencyDump < LATENCY_DUMP_INTERVAL)
+        return;
+    remoteVars.lastLatencyDump=time(NULL);
+
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    memcpy(hist, remoteVars.latencyHist, sizeof(hist));
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+
+    ptr=fopen(remoteVars.latencyFile, "wt");
+    if(!ptr)
+    {
+        EPHYR_DBG("Can't open file %s for writing latency histograms", remoteVars.latencyFile);
+        return;
+    }
+    fprintf(ptr, "stage");
+    for(j=0;j<LAT_BUCKETS-1;++j)
+        fprintf(ptr, " <%d", 1<<j);
+    fprintf(ptr, " >=%d\n", 1<<(LAT_BUCKETS-2));
+    for(i=0;i<LAT_STAGES;++i)
+    {
+        fprintf(ptr, "%s", stages[i]);
+        for(j=0;j<LAT_BUCKETS;++j)
+            fprintf(ptr, " %u", hist[i][j]);
+        fprintf(ptr, "\n");
+    }
+    fclose(ptr);
+}
+
 void send_h264_data(unsigned char* buffer,int length){
     // EPHYR_DBG("38\n");
     int l = 0;
@@ -1773,17 +2344,15 @@ void send_h264_data(unsigned char* buffer,int length){
     //  *((long*)buf)=time;
     //sprintf(buf, "%ld", time);
     // remote_write_socket(remoteVars.clientsock_tcp, buf, 16);
-    
-    int sent = 0;
-    while(sent < length){
-        l = remote_write_socket(remoteVars.clientsock_tcp,buffer+sent,
-                        ((length-sent)<MAXMSGSIZE)?(length-sent):MAXMSGSIZE);
-        if(l<0)
-        {
-            EPHYR_DBG("Error sending file!!!!!");
-            break;
-        }
-        sent+=l;
+
+    //NAL units of the frame are following each other in one buffer, send them with one syscall
+    struct iovec iov;
+    iov.iov_base=buffer;
+    iov.iov_len=length;
+    l = remote_writev_socket(remoteVars.clientsock_tcp, &iov, 1);
+    if(l<0)
+    {
+        EPHYR_DBG("Error sending file!!!!!");
     }
 }
 
@@ -1981,6 +2550,16 @@ void encode_main_img3(void){
 void encode_main_img4(void){
     unsigned char* out_buffer;
     int out_size;
+    uint64_t encodeStart=remote_time_usec();
+    uint64_t inputTime=0, sendStart;
+
+    //H264 data has no header for input id, only measure latency of the first frame after input
+    if(remoteVars.pendingInputTime)
+    {
+        if(encodeStart-remoteVars.pendingInputTime < LATENCY_INPUT_TIMEOUT*1000)
+            inputTime=remoteVars.pendingInputTime;
+        remoteVars.pendingInputTime=0;
+    }
 
     pthread_mutex_lock(&remoteVars.mainimg_mutex);
 
@@ -1991,6 +2570,7 @@ void encode_main_img4(void){
     }
 
     pthread_mutex_unlock(&remoteVars.mainimg_mutex);
+    sendStart=remote_time_usec();
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
 
     // EPHYR_DBG("out_size: %d\n",out_size);
@@ -2000,17 +2580,186 @@ void encode_main_img4(void){
 
     pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
 
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    if(inputTime)
+    {
+        record_latency(LAT_DAMAGE, inputTime, encodeStart);
+        record_latency(LAT_TOTAL, inputTime, remote_time_usec());
+    }
+    record_latency(LAT_ENCODE, encodeStart, sendStart);
+    record_latency(LAT_SEND, sendStart, remote_time_usec());
+    pthread_mutex_unlock(&remoteVars.cache_mutex);    //there is no send thread for H264
+    dump_latency_histograms();
+}
+
+/*
+ * free compressed regions of the frame and release the element it references.
+ * warning! cache_mutex should be locked by thread calling this function!
+ */
+static
+void release_frame_regions(struct cache_elem* frame)
+{
+    if(frame->source)
+        frame->source->busy--;
+    frame->source=0;
+
+    for(int i=0;i<9;++i)
+    {
+        if(frame->regions[i].size)
+        {
+            free(frame->regions[i].compressed_data);
+            frame->regions[i].size=0;
+        }
+        frame->regions[i].compressed_data=0;
+        frame->regions[i].source_crc=0;
+        frame->regions[i].rect.size.width=0;
+    }
+    frame->compressed_size=0;
+}
+
+/*
+ * check if window updates should be sent now. Changes which are only moving or resizing windows
+ * are sent not more often than winUpdateInterval, the latest state of window is sent when interval is over.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+BOOL window_updates_due(void)
+{
+    struct remoteWindow* rwin;
+    if(!remoteVars.windowsUpdated)
+        return FALSE;
+    if(!remoteVars.winUpdateInterval ||
+        MyGetTickCount()-remoteVars.lastWinUpdateTime >= remoteVars.winUpdateInterval)
+        return TRUE;
+    for(rwin=remoteVars.windowList; rwin; rwin=rwin->next)
+    {
+        if(rwin->state == NEW || rwin->state == WDEL)
+            return TRUE;
+        if(rwin->state == CHANGED &&
+           (window_changed_fields(rwin) & ~(WINFIELD_X|WINFIELD_Y|WINFIELD_W|WINFIELD_H)))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * check if there is some data to send.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+BOOL have_data_to_send(void)
+{
+    BOOL have_data = FALSE;
+
+    if(remoteVars.first_sendqueue_element || remoteVars.cache_rebuilt || window_updates_due())
+        return TRUE;
+
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    have_data=(remoteVars.first_resend_request != NULL);
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+    if(have_data)
+        return TRUE;
+
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
+    have_data=(remoteVars.firstCursor || remoteVars.first_deleted_cursor);
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
+    if(have_data)
+        return TRUE;
+
+    pthread_mutex_lock(&remoteVars.selection_mutex);
+    have_data=(remoteVars.selstruct.firstOutputChunk || remoteVars.selstruct.requestSelection[PRIMARY] ||
+               remoteVars.selstruct.requestSelection[CLIPBOARD]);
+    pthread_mutex_unlock(&remoteVars.selection_mutex);
+    return have_data;
+}
+
+/*
+ * wake up the sending thread after adding data to one of the queues.
+ * Should be called without locked mutexes
+ */
+void remote_wakeup_send_thread(void)
+{
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    pthread_cond_signal(&remoteVars.have_sendqueue_cond);
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+}
+
+/*
+ * returns the screen region which should be refined or -1 if we don't need to refine regions now.
+ * Regions are refined only if no frames were sent during REFINE_DELAY
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+int refine_region_due(void)
+{
+    if(remoteVars.first_sendqueue_element || (MyGetTickCount() - remoteVars.lastFrameTime) < REFINE_DELAY)
+        return -1;
+    return getDirtyScreenRegion();
+}
+
+/*
+ * choose the class of the next message from the classes which have data to send.
+ * Every class has a "pass" - amount of sent data divided by the weight of the class.
+ * The class with smallest pass is sent first, so every class gets share of bandwidth
+ * according to it's weight and no class can starve.
+ */
+static
+int schedule_send_class(BOOL* ready)
+{
+    int i;
+    int next=-1;
+
+    for(i=0;i<SEND_CLASSES;++i)
+    {
+        if(!ready[i])
+            continue;
+        //class was idle, it can't use the bandwidth it didn't use before
+        if(remoteVars.sendPass[i] < remoteVars.sendVTime)
+            remoteVars.sendPass[i]=remoteVars.sendVTime;
+        if(next == -1 || remoteVars.sendPass[i] < remoteVars.sendPass[next])
+            next=i;
+    }
+    if(next != -1)
+        remoteVars.sendVTime=remoteVars.sendPass[next];
+    return next;
+}
+
+static
+void account_sent_data(int sendClass, uint32_t length)
+{
+    //count message header as well, so empty messages are not free
+    remoteVars.sendPass[sendClass]+=((uint64_t)length+56)*1024/remoteVars.sendWeight[sendClass];
+}
+
+/*
+ * sleep with timeout till signal from other thread is sent.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+int wait_for_send_queue(unsigned int us_to_wait)
+{
+    struct timespec ts;
+    struct timeval tp;
+
+    gettimeofday(&tp, NULL);
+    /* Convert from timeval to timespec */
+    ts.tv_sec  = tp.tv_sec;
+    ts.tv_nsec = tp.tv_usec * 1000+us_to_wait*1000UL;//wait us_to_wait microseconds
+    while(ts.tv_nsec>=1000000000UL)
+    {
+        ts.tv_nsec-=1000000000UL;
+        ++ts.tv_sec;
+    }
+    return pthread_cond_timedwait(&remoteVars.have_sendqueue_cond, &remoteVars.sendqueue_mutex, &ts);
 }
 
 static
 void *send_frame_thread (void *threadid)
 {
     enum SelectionType r;
-    int dirty_region;
 //wait 100*1000 microseconds
     unsigned int ms_to_wait=100*1000;
-    struct timespec ts;
-    struct timeval tp;
+    BOOL wasCongested=FALSE;
 
 #ifdef EPHYR_WANT_DEBUG
     debug_sendThreadId=pthread_self();
@@ -2018,11 +2767,29 @@ void *send_frame_thread (void *threadid)
 
     while(1)
     {
+        struct OutputChunk* chunk = NULL;
+        struct cursorFrame* cframe = NULL;
+        BOOL requestSelection[2] = {FALSE, FALSE};
+        BOOL ready[SEND_CLASSES] = {FALSE};
+        int dirty_region = -1;
+        int sendClass = -1;
+        BOOL congested = FALSE;
+        uint32_t resent = 0;
+        BOOL haveResendRequests = FALSE;
+        BOOL boosted = FALSE;
+        BOOL viewersJoined = FALSE;
+        struct cache_elem* frame = NULL;
+        uint32_t  x=0, y = 0, winId=0, crc=0, inputId=0;
+        int32_t width = 0, height = 0;
+        uint32_t length = 0;
+        uint64_t inputTime = 0, queueTime = 0, sendTime = 0;
+
         pthread_mutex_lock(&remoteVars.sendqueue_mutex);
         if(!remoteVars.client_connected)
         {
             EPHYR_DBG ("TCP connection closed\n");
             close_client_sockets();
+            clear_retransmission_store();
             pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
             break;
         }
@@ -2032,45 +2799,37 @@ void *send_frame_thread (void *threadid)
         if(remoteVars.client_version && ! remoteVars.server_version_sent)
         {
             //the client supports versions and we didn't send our version yet
+            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
             remote_sendVersion();
+            pthread_mutex_lock(&remoteVars.sendqueue_mutex);
         }
 
 
-        if(!remoteVars.first_sendqueue_element && !remoteVars.firstCursor && !remoteVars.selstruct.firstOutputChunk &&
-            !remoteVars.cache_rebuilt && !remoteVars.windowsUpdated)
+        if(!have_data_to_send() && refine_region_due() == -1)
         {
-            gettimeofday(&tp, NULL);
-            /* Convert from timeval to timespec */
-            ts.tv_sec  = tp.tv_sec;
-            ts.tv_nsec = tp.tv_usec * 1000+ms_to_wait*1000UL;//wait ms_to_wait microseconds
-            if(ts.tv_nsec>=1000000000UL)
+            unsigned int us_to_wait=ms_to_wait;
+            if(remoteVars.windowsUpdated)
             {
-                ts.tv_nsec-=1000000000UL;
-                ++ts.tv_sec;
+                //don't sleep longer than till the postponed window updates are due
+                long left=remoteVars.winUpdateInterval-(MyGetTickCount()-remoteVars.lastWinUpdateTime);
+                if(left>0 && left*1000 < us_to_wait)
+                    us_to_wait=left*1000;
             }
             /*sleep with timeout till signal from other thread is sent*/
-            switch(pthread_cond_timedwait(&remoteVars.have_sendqueue_cond, &remoteVars.sendqueue_mutex, &ts))
+            switch(wait_for_send_queue(us_to_wait))
             {
                 case 0: //have a signal from other thread, continue execution
-                    ms_to_wait=100*1000; //reset timer
                     break;
-                case ETIMEDOUT: //timeout is ocured, we have nothing else to do, let's see if we need to update some screen regions
-                    dirty_region=getDirtyScreenRegion();
-                    if(dirty_region!=-1)
+                case ETIMEDOUT: //timeout is ocured, if we don't need to refine screen regions, send server alive event if needed
+                    if(getDirtyScreenRegion() == -1)
                     {
-                        send_dirty_region(dirty_region);
-                        ms_to_wait=200; //we can start to repaint faster till we don't have any new data incoming
-                    }
-                    else
-                    {
-                        /*send server alive event if needed*/
-                        ms_to_wait=100*1000; //reset timer
+                        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
                         sendServerAlive();
+                        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
                     }
                     break;
                 default:
                     EPHYR_DBG("Error is occured in pthread_cond_timedwait");
-                    ms_to_wait=100*1000; //reset timer
                     break;
             }
 
@@ -2078,8 +2837,15 @@ void *send_frame_thread (void *threadid)
 
         /* mutex is locked on this point */
 
-        //if windows list is updated send changes to client
-        if(remoteVars.windowsUpdated)
+        //client acknowledged bigger dgrams, use them for the next packets
+        if(remoteVars.udpResizePending)
+        {
+            remoteVars.udpResizePending=FALSE;
+            update_udp_dgram_size();
+        }
+
+        //if windows list is updated send changes to client, moving windows are waiting for frames
+        if(window_updates_due())
         {
             remote_process_window_updates();
         }
@@ -2090,99 +2856,101 @@ void *send_frame_thread (void *threadid)
         {
             remoteVars.cache_rebuilt=FALSE;
             pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+            viewersJoined=activate_pending_viewers();
             send_reinit_notification();
-            clean_everything();
             pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-        }
-
-        //only send output selection chunks if there are no frames and cursors in the queue
-        //selections can take a lot of bandwidth and have less priority
-        if(remoteVars.selstruct.firstOutputChunk && !remoteVars.first_sendqueue_element && !remoteVars.firstCursor)
-        {
-            //get chunk from queue
-            struct OutputChunk* chunk=remoteVars.selstruct.firstOutputChunk;
-            remoteVars.selstruct.firstOutputChunk=chunk->next;
-            if(!remoteVars.selstruct.firstOutputChunk)
-            {
-                remoteVars.selstruct.lastOutputChunk=NULL;
-            }
-
-            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-            //send chunk
-            send_output_selection(chunk);
-            //free chunk and it's data
-            if(chunk->data)
+            clean_everything();
+            if(viewersJoined)
             {
-                free(chunk->data);
+                //screen for viewers is repainted from main thread, queues are clean now
+                pthread_mutex_lock(&remoteVars.outbuf_mutex);
+                remoteVars.viewerRepaint=TRUE;
+                pthread_mutex_unlock(&remoteVars.outbuf_mutex);
             }
-            //                 EPHYR_DBG(" REMOVE CHUNK %p %p %p", remoteVars.selstruct.firstOutputChunk, remoteVars.selstruct.lastOutputChunk, chunk);
-            free(chunk);
-
-            pthread_mutex_lock(&remoteVars.sendqueue_mutex);
         }
 
-        //check if we need to request the selection from client
-        if(remoteVars.selstruct.requestSelection[PRIMARY] || remoteVars.selstruct.requestSelection[CLIPBOARD])
-        {
-            for(r=PRIMARY; r<=CLIPBOARD; ++r)
-            {
-                if(remoteVars.selstruct.requestSelection[r])
-                {
-                    remoteVars.selstruct.requestSelection[r]=FALSE;
+        //find out which classes have data to send
+        ready[SEND_FRAME]=(remoteVars.first_sendqueue_element != NULL);
+        //user is waiting for the feedback on input, send it before anything else
+        boosted=(ready[SEND_FRAME] && remoteVars.first_sendqueue_element->boosted);
+        dirty_region=refine_region_due();
+        ready[SEND_REFINE]=(dirty_region != -1);
 
-                    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-                    //send request for selection
-                    request_selection_from_client(r);
+        pthread_mutex_lock(&remoteVars.cursor_mutex);
+        ready[SEND_CURSOR]=(remoteVars.firstCursor != NULL);
+        pthread_mutex_unlock(&remoteVars.cursor_mutex);
 
-                    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-                }
-            }
-        }
+        pthread_mutex_lock(&remoteVars.cache_mutex);
+        haveResendRequests=(remoteVars.first_resend_request != NULL);
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
 
-        if(remoteVars.firstCursor)
+        pthread_mutex_lock(&remoteVars.selection_mutex);
+        //check if we need to request the selection from client, the requests are small, send them immediately
+        for(r=PRIMARY; r<=CLIPBOARD; ++r)
         {
-            /* get cursor from queue, delete it from queue, unlock mutex and send cursor. After sending free cursor */
-            struct cursorFrame* cframe=remoteVars.firstCursor;
-
-            if(remoteVars.firstCursor->next)
-                remoteVars.firstCursor=remoteVars.firstCursor->next;
-            else
-                remoteVars.firstCursor=remoteVars.lastCursor=0;
-
-            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-            send_cursor(cframe);
-            if(cframe->data)
-                free(cframe->data);
-            free(cframe);
-
+            requestSelection[r]=remoteVars.selstruct.requestSelection[r];
+            remoteVars.selstruct.requestSelection[r]=FALSE;
         }
-        else
+        //selections which are fitting in one chunk and notifications are "selection" class
+        //chunks of big selections are "bulk" class
+        chunk=remoteVars.selstruct.firstOutputChunk;
+        if(chunk)
         {
+            if(chunk->firstChunk && chunk->lastChunk)
+                ready[SEND_SELECTION]=TRUE;
+            else
+                ready[SEND_BULK]=TRUE;
+            chunk=NULL;
+        }
+        pthread_mutex_unlock(&remoteVars.selection_mutex);
 
-            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        //client is not reading fast enough. Don't add new frames or big chunks to output buffer,
+        //frames waiting in queue will be replaced by newer updates
+        congested=remote_output_congested();
+        if(congested && !boosted && (ready[SEND_FRAME] || ready[SEND_REFINE] || ready[SEND_BULK]))
+        {
+            if(!wasCongested)
+            {
+                EPHYR_DBG("output is congested, %lu bytes are waiting", (unsigned long)remote_output_backlog());
+                if(remoteVars.jpegQuality >10)
+                    remoteVars.jpegQuality-=10;
+            }
+            ready[SEND_FRAME]=ready[SEND_REFINE]=ready[SEND_BULK]=FALSE;
+            if(!ready[SEND_CURSOR] && !ready[SEND_SELECTION] && !requestSelection[PRIMARY] && !requestSelection[CLIPBOARD] &&
+               !haveResendRequests)
+            {
+                //nothing else to send, check again when the buffer is drained a bit
+                wait_for_send_queue(OUTBUF_RETRY_DELAY*1000);
+                wasCongested=congested;
+                pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+                continue;
+            }
         }
+        wasCongested=congested;
 
+        if(boosted)
+            sendClass=SEND_FRAME;
+        else
+            sendClass=schedule_send_class(ready);
 
-        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-        if(remoteVars.first_sendqueue_element)
+        //get the data of scheduled class from it's queue
+        if(sendClass == SEND_FRAME)
         {
             int elems=queue_elements();
-            struct cache_elem* frame = NULL;
             struct sendqueue_element* current = NULL;
-            uint32_t  x=0, y = 0, winId=0;
-            int32_t width, height = 0;
 
             if(remoteVars.maxfr<elems)
             {
                 remoteVars.maxfr=elems;
             }
 //             EPHYR_DBG(" frames in queue %d, quality %d", elems, remoteVars.jpegQuality);
-            if(elems > 3)
+            //boosted frame is jumping over the queue, it says nothing about the speed of connection
+            if(elems > 3 && !boosted)
             {
                 if(remoteVars.jpegQuality >10)
                     remoteVars.jpegQuality-=10;
             }
-            if(elems <3)
+            if(elems <3 && !boosted)
             {
                 if(remoteVars.jpegQuality <remoteVars.initialJpegQuality)
                     remoteVars.jpegQuality+=10;
@@ -2204,73 +2972,171 @@ void *send_frame_thread (void *threadid)
             width=current->width;
             height=current->height;
             winId=current->winId;
+            inputId=current->inputId;
+            inputTime=current->inputTime;
+            queueTime=current->queueTime;
             free(current);
+            sendTime=remote_time_usec();
 
             if(frame)
             {
-                uint32_t crc = frame->crc;
-                uint32_t frame_width=frame->width;
-                uint32_t frame_height=frame->height;
-
-                /* unlock sendqueue for main thread */
-
-                markDirtyRegions(x, y, frame_width, frame_height, remoteVars.jpegQuality, winId);
-                pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-                send_frame(frame_width, frame_height, x, y, crc, frame->regions, winId);
+                crc=frame->crc;
+                width=frame->width;
+                height=frame->height;
             }
+            markDirtyRegions(x, y, width, height, remoteVars.jpegQuality, winId);
+        }
+        else if(sendClass == SEND_CURSOR)
+        {
+            pthread_mutex_lock(&remoteVars.cursor_mutex);
+            /* get cursor from queue, delete it from queue, unlock mutex and send cursor. After sending free cursor */
+            cframe=remoteVars.firstCursor;
+
+            if(remoteVars.firstCursor->next)
+                remoteVars.firstCursor=remoteVars.firstCursor->next;
             else
+                remoteVars.firstCursor=remoteVars.lastCursor=0;
+            pthread_mutex_unlock(&remoteVars.cursor_mutex);
+        }
+        else if(sendClass == SEND_SELECTION || sendClass == SEND_BULK)
+        {
+            pthread_mutex_lock(&remoteVars.selection_mutex);
+            //get chunk from queue, selection thread could remove the chunks while mutex was unlocked
+            chunk=remoteVars.selstruct.firstOutputChunk;
+            if(chunk)
             {
-//                 EPHYR_DBG("Sending main image or screen update");
-                markDirtyRegions(x, y, width, height, remoteVars.jpegQuality, winId);
-                pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-                sendMainImageFromSendThread(width, height, x, y, winId);
-            }
-            pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-            if(frame)
-            {
-                frame->sent=TRUE;
-                frame->busy--;
-                if(frame->source)
-                    frame->source->busy--;
-                frame->source=0;
-
-                for(int i=0;i<9;++i)
+                remoteVars.selstruct.firstOutputChunk=chunk->next;
+                if(!remoteVars.selstruct.firstOutputChunk)
+                {
+                    remoteVars.selstruct.lastOutputChunk=NULL;
+                }
+                remoteVars.selstruct.outputChunkBytes-=(chunk->compressed_size)?chunk->compressed_size:chunk->size;
+                //remember if client is receiving selection in several chunks
+                if(chunk->firstChunk)
+                {
+                    remoteVars.selstruct.outputInProgressMime[chunk->selection]=chunk->mimeData;
+                }
+                if(!chunk->firstChunk && !remoteVars.selstruct.outputInProgress[chunk->selection])
                 {
-                    if(frame->regions[i].size)
+                    //client didn't get the first chunk of this selection or the transfer is aborted, drop the rest of it
+                    if(chunk->data)
                     {
-                        free(frame->regions[i].compressed_data);
-                        frame->regions[i].size=0;
+                        free(chunk->data);
                     }
-                    frame->regions[i].source_crc=0;
-                    frame->regions[i].rect.size.width=0;
+                    free(chunk);
+                    chunk=NULL;
+                }
+                else
+                {
+                    remoteVars.selstruct.outputInProgress[chunk->selection]=!chunk->lastChunk;
+                }
+                //queue has space for the next chunks, selection thread can continue reading INCR property
+                if(remoteVars.selstruct.incrPausedProperty && !remoteVars.selstruct.incrResumeSent &&
+                   remoteVars.selstruct.outputChunkBytes <= SELECTION_PIPELINE_SIZE/2)
+                {
+                    remoteVars.selstruct.incrResumeSent=TRUE;
+                    selection_queue_drained_notify();
                 }
             }
-            if(remoteVars.cache_size>CACHEMAXELEMENTS)
+            pthread_mutex_unlock(&remoteVars.selection_mutex);
+        }
+
+        if(sendClass == SEND_REFINE)
+        {
+            //send_dirty_region unlocks mutex while sending
+            account_sent_data(SEND_REFINE, send_dirty_region(dirty_region));
+        }
+
+        /* unlock sendqueue for main thread, sending and compression of data can take time */
+        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+
+        for(r=PRIMARY; r<=CLIPBOARD; ++r)
+        {
+            if(requestSelection[r])
             {
-                clear_frame_cache(CACHEMAXELEMENTS);
+                //send request for selection
+                request_selection_from_client(r);
             }
-            if(remoteVars.first_deleted_elements)
+        }
+
+        send_mtu_probe();
+
+        //client is waiting for lost frames, resend them immediately
+        resent=process_resend_requests();
+        if(resent)
+        {
+            account_sent_data(SEND_FRAME, resent);
+        }
+
+        if(chunk)
+        {
+            //send chunk
+            account_sent_data(sendClass, send_output_selection(chunk));
+            //free chunk and it's data
+            if(chunk->data)
             {
-                send_deleted_elements();
+                free(chunk->data);
             }
-            if(remoteVars.first_deleted_cursor)
+            //                 EPHYR_DBG(" REMOVE CHUNK %p %p %p", remoteVars.selstruct.firstOutputChunk, remoteVars.selstruct.lastOutputChunk, chunk);
+            free(chunk);
+        }
+
+        if(cframe)
+        {
+            account_sent_data(SEND_CURSOR, send_cursor(cframe));
+            if(cframe->data)
+                free(cframe->data);
+            free(cframe);
+        }
+        send_deleted_cursors();
+
+
+        if(sendClass == SEND_FRAME)
+        {
+            remoteVars.frameInputId=inputId;
+            if(frame)
             {
-                send_deleted_cursors();
+                length=send_frame(width, height, x, y, crc, frame->regions, winId);
             }
-            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+            else
+            {
+//                 EPHYR_DBG("Sending main image or screen update");
+                length=sendMainImageFromSendThread(width, height, x, y, winId);
+            }
+            account_sent_data(SEND_FRAME, length);
+            remoteVars.lastFrameTime=MyGetTickCount();
+            remoteVars.frameInputId=0;
+
+            pthread_mutex_lock(&remoteVars.cache_mutex);
+            record_latency(LAT_QUEUE, queueTime, sendTime);
+            record_latency(LAT_SEND, sendTime, remote_time_usec());
+            if(inputTime)
+            {
+                record_latency(LAT_TOTAL, inputTime, remote_time_usec());
+            }
+            if(frame)
+            {
+                frame->sent=TRUE;
+                frame->busy--;
+                release_frame_regions(frame);
+            }
+            if(remoteVars.cache_size>CACHEMAXELEMENTS)
+            {
+                clear_frame_cache(CACHEMAXELEMENTS);
+            }
+            pthread_mutex_unlock(&remoteVars.cache_mutex);
+
+            send_deleted_elements();
             remoteVars.framenum++;
         }
-        else
-        {
-            pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-        }
+        dump_latency_histograms();
     }
     EPHYR_DBG("exit sending thread");
     remoteVars.send_thread_id=0;
     pthread_exit(0);
 }
 
-/* warning! sendqueue_mutex should be locked by thread calling this function! */
+/* warning! selection_mutex should be locked by thread calling this function! */
 void clear_output_selection(void)
 {
     struct OutputChunk* chunk=remoteVars.selstruct.firstOutputChunk;
@@ -2287,9 +3153,91 @@ void clear_output_selection(void)
         free(prev_chunk);
     }
     remoteVars.selstruct.firstOutputChunk=remoteVars.selstruct.lastOutputChunk=NULL;
+    remoteVars.selstruct.outputChunkBytes=0;
+    remoteVars.selstruct.outputInProgress[PRIMARY]=remoteVars.selstruct.outputInProgress[CLIPBOARD]=FALSE;
+    //next client doesn't have any of our selections
+    remoteVars.selstruct.lastSentValid[PRIMARY]=remoteVars.selstruct.lastSentValid[CLIPBOARD]=FALSE;
+    //selection thread can continue reading, selection owner is not waiting forever
+    if(remoteVars.selstruct.incrPausedProperty && !remoteVars.selstruct.incrResumeSent)
+    {
+        remoteVars.selstruct.incrResumeSent=TRUE;
+        selection_queue_drained_notify();
+    }
+}
+
+/* warning! selection_mutex should be locked by thread calling this function! */
+void remove_output_selection(enum SelectionType sel)
+{
+    //selection sel has a new owner, chunks of the old one which are still in queue are obsolete.
+    //If client already got the first chunk of selection, the rest of it is still sent, so the transfer is finished
+    struct OutputChunk* chunk=remoteVars.selstruct.firstOutputChunk;
+    struct OutputChunk* prev_chunk=NULL;
+    struct OutputChunk* next_chunk;
+    uint32_t removed=0;
+    BOOL finishing=remoteVars.selstruct.outputInProgress[sel];
+
+    while(chunk)
+    {
+        next_chunk=chunk->next;
+        if(chunk->selection != sel || finishing)
+        {
+            if(chunk->selection == sel && chunk->lastChunk)
+                finishing=FALSE;
+            prev_chunk=chunk;
+            chunk=next_chunk;
+            continue;
+        }
+        if(prev_chunk)
+            prev_chunk->next=next_chunk;
+        else
+            remoteVars.selstruct.firstOutputChunk=next_chunk;
+        if(remoteVars.selstruct.lastOutputChunk == chunk)
+            remoteVars.selstruct.lastOutputChunk=prev_chunk;
+        remoteVars.selstruct.outputChunkBytes-=(chunk->compressed_size)?chunk->compressed_size:chunk->size;
+        if(chunk->data)
+        {
+            free(chunk->data);
+        }
+        free(chunk);
+        ++removed;
+        chunk=next_chunk;
+    }
+    if(finishing)
+    {
+        //the rest of selection will never come (reading of INCR property is canceled), abort the transfer with empty last chunk.
+        //Total size 0 tells client to drop the part it got, older clients are dropping it when the next selection is coming
+        chunk=NULL;
+        if(remoteVars.client_version >= 17)
+            chunk=malloc(sizeof(struct OutputChunk));
+        if(chunk)
+        {
+            memset((void*)chunk,0,sizeof(struct OutputChunk));
+            chunk->selection=sel;
+            chunk->mimeData=remoteVars.selstruct.outputInProgressMime[sel];
+            chunk->totalSize=0;
+            chunk->lastChunk=TRUE;
+            if(!remoteVars.selstruct.lastOutputChunk)
+            {
+                remoteVars.selstruct.lastOutputChunk=remoteVars.selstruct.firstOutputChunk=chunk;
+            }
+            else
+            {
+                remoteVars.selstruct.lastOutputChunk->next=chunk;
+                remoteVars.selstruct.lastOutputChunk=chunk;
+            }
+            EPHYR_DBG("aborting transfer of selection %d", sel);
+        }
+        remoteVars.selstruct.lastSentValid[sel]=FALSE;
+    }
+    if(removed)
+    {
+        EPHYR_DBG("removed %d obsolete chunks of selection %d", removed, sel);
+        //if client got only a part of the last selection, it doesn't have it
+        remoteVars.selstruct.lastSentValid[sel]=FALSE;
+    }
 }
 
-/* warning! sendqueue_mutex should be locked by thread calling this function! */
+/* warning! sendqueue_mutex and cache_mutex should be locked by thread calling this function! */
 static
 void clear_send_queue(void)
 {
@@ -2315,7 +3263,7 @@ void clear_send_queue(void)
 
 /*
  * remove elements from cache and release all images if existing.
- * warning! sendqueue_mutex should be locked by thread calling this function!
+ * warning! cache_mutex should be locked by thread calling this function!
  */
 void clear_frame_cache(uint32_t max_elements)
 {
@@ -2340,7 +3288,8 @@ void clear_frame_cache(uint32_t max_elements)
         }
 
         //add element to deleted list if client is connected and we are not deleting all frame list
-        if(remoteVars.client_connected && max_elements)
+        //elements which were dropped from queue before sending are unknown to client
+        if(remoteVars.client_connected && max_elements && remoteVars.first_cache_element->sent)
         {
             /* add deleted element to the list for sending */
             struct deleted_elem* delem=malloc(sizeof(struct deleted_elem));
@@ -2438,6 +3387,13 @@ void delete_all_windows(void)
         free(tmp);
     }
     remoteVars.windowList=NULL;
+    memset(remoteVars.windowHash, 0, sizeof(remoteVars.windowHash));
+    //new client doesn't have any names or icons
+    memset(remoteVars.sentWinNames, 0, sizeof(remoteVars.sentWinNames));
+    memset(remoteVars.sentWinIcons, 0, sizeof(remoteVars.sentWinIcons));
+    remoteVars.sentWinNamesNext=remoteVars.sentWinIconsNext=0;
+    //client needs all windows again
+    remoteVars.windowsFullCheck=TRUE;
 }
 
 void disconnect_client(void)
@@ -2462,6 +3418,12 @@ void disconnect_client(void)
 
 
     pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    //write the rest of output buffer if client is still reading and stop flush thread
+    stop_output_flushing(FALSE);
+    //viewers are not watching without client, server socket was left open for them
+    close_viewers();
+    if(remoteVars.serversock_tcp != -1)
+        close_server_socket();
 }
 
 void unpack_current_chunk_to_buffer(struct InputBuffer* selbuff)
@@ -2551,6 +3513,9 @@ void readInputSelectionBuffer(char* buff)
         }
     }
 
+    //write received data of big selection to file
+    release_selection_buffer(selbuff);
+
     if(selbuff->bytesReady==selbuff->size)
     {
         //selection buffer received completely
@@ -2569,7 +3534,7 @@ void readInputSelectionBuffer(char* buff)
     pthread_mutex_unlock(&remoteVars.selstruct.inMutex);
 }
 
-void readInputSelectionHeader(char* buff)
+void readInputSelectionHeader(char* buff, uint32_t length)
 {
 
     //read the input selection event.
@@ -2614,6 +3579,14 @@ void readInputSelectionHeader(char* buff)
      EPHYR_DBG("HAVE NEW INCOMING SELECTION Chunk: sel %d size %d mime %d compressed size %d, total %d",destination, size, mime, compressedSize, totalSize);
 
 
+    if(firstChunk)
+    {
+        //client has a new selection, the one we sent before is not there anymore
+        pthread_mutex_lock(&remoteVars.selection_mutex);
+        remoteVars.selstruct.lastSentValid[destination]=FALSE;
+        pthread_mutex_unlock(&remoteVars.selection_mutex);
+    }
+
     //lock selection
     pthread_mutex_lock(&remoteVars.selstruct.inMutex);
 
@@ -2625,13 +3598,9 @@ void readInputSelectionHeader(char* buff)
     if(firstChunk && lastChunk && remoteVars.selstruct.clientSupportsExetndedSelection && (totalSize == 0) &&(size == 0))
     {
         EPHYR_DBG("Selection notify from client for %d", destination);
-        if(selbuff->size && selbuff->data)
-        {
-            free(selbuff->data);
-        }
+        free_selection_buffer(selbuff);
         selbuff->size=0;
         selbuff->mimeData=mime;
-        selbuff->data=0;
         selbuff->bytesReady=0;
         selbuff->state=NOTIFIED;
 // own selection
@@ -2645,13 +3614,10 @@ void readInputSelectionHeader(char* buff)
     if(firstChunk)
     {
         //if it's first chunk, initialize our selection buffer
-        if(selbuff->size && selbuff->data)
-        {
-            free(selbuff->data);
-        }
+        free_selection_buffer(selbuff);
         selbuff->size=totalSize;
         selbuff->mimeData=mime;
-        selbuff->data=malloc(totalSize);
+        alloc_selection_buffer(selbuff, totalSize);
         selbuff->bytesReady=0;
     }
 
@@ -2662,18 +3628,35 @@ void readInputSelectionHeader(char* buff)
     selbuff->currentChunkCompressedData=NULL;
     selbuff->currentChunkCompressedSize=0;
 
+    if(compressedSize)
+        selbuff->currentChunkCompressedData=malloc(compressedSize);
+
+    //data of chunk is coming in the same event, it should be there completely and fit in the rest of selection buffer,
+    //otherwise client is sending broken data
+    if(length < headerSize || ((compressedSize)?compressedSize:size) > length-headerSize ||
+       (size && !selbuff->data) || size > selbuff->size - selbuff->bytesReady ||
+       (compressedSize && !selbuff->currentChunkCompressedData))
+    {
+        EPHYR_DBG("WARNING: broken chunk of %d bytes in event of %d bytes for selection %d, dropping selection", size, length, destination);
+        free(selbuff->currentChunkCompressedData);
+        selbuff->currentChunkCompressedData=NULL;
+        free_selection_buffer(selbuff);
+        selbuff->size=selbuff->bytesReady=0;
+        pthread_mutex_unlock(&remoteVars.selstruct.inMutex);
+        return;
+    }
+
     //if compressed data will be read in buffer for compressed data
     if(compressedSize)
     {
-        selbuff->currentChunkCompressedData=malloc(compressedSize);
         selbuff->currentChunkCompressedSize=compressedSize;
-        l=(compressedSize < EVLENGTH-headerSize)?compressedSize:(EVLENGTH-headerSize);
+        l=(compressedSize < length-headerSize)?compressedSize:(length-headerSize);
         memcpy(selbuff->currentChunkCompressedData, buff+headerSize, l);
     }
     else
     {
         //read the selection data from header
-        l=(size < EVLENGTH-headerSize)?size:(EVLENGTH-headerSize);
+        l=(size < length-headerSize)?size:(length-headerSize);
         memcpy(selbuff->data+selbuff->bytesReady, buff+headerSize, l);
 
         selbuff->bytesReady+=l;
@@ -2706,6 +3689,9 @@ void readInputSelectionHeader(char* buff)
 
     }
 
+    //write received data of big selection to file
+    release_selection_buffer(selbuff);
+
     if(selbuff->size == selbuff->bytesReady)
     {
         //Selection is completed
@@ -2725,7 +3711,7 @@ void readInputSelectionHeader(char* buff)
     pthread_mutex_unlock(&remoteVars.selstruct.inMutex);
 }
 
-//length is only important for UDP connections. In case of TCP it'll be always EVLENGTH
+//length of event, for framed events it can be bigger than EVLENGTH
 BOOL remote_process_client_event ( char* buff , int length)
 {
     uint32_t event_type=*((uint32_t*)buff);
@@ -2747,6 +3733,7 @@ BOOL remote_process_client_event ( char* buff , int length)
             uint32_t y=*((uint32_t*)buff+2);
 
             //                    EPHYR_DBG("HAVE MOTION EVENT %d, %d from client\n",x,y);
+            remote_input_received((remoteVars.client_version>=12)?*((uint32_t*)buff+3):0);
             ephyrClientMouseMotion(x,y);
             break;
         }
@@ -2756,6 +3743,8 @@ BOOL remote_process_client_event ( char* buff , int length)
             uint32_t state=*((uint32_t*)buff+1);
             uint32_t button=*((uint32_t*)buff+2);
             //                    EPHYR_DBG("HAVE BUTTON PRESS/RELEASE EVENT %d, %d from client\n",state,button);
+            remote_input_received((remoteVars.client_version>=12)?*((uint32_t*)buff+3):0);
+            remote_boost_input();
             ephyrClientButton(event_type,state, button);
             break;
         }
@@ -2764,6 +3753,8 @@ BOOL remote_process_client_event ( char* buff , int length)
             uint32_t state=*((uint32_t*)buff+1);
             uint32_t key=*((uint32_t*)buff+2);
             //                    EPHYR_DBG("HAVE KEY PRESS EVENT state: %d(%x), key: %d(%x) from client\n",state,state, key, key);
+            remote_input_received((remoteVars.client_version>=12)?*((uint32_t*)buff+3):0);
+            remote_boost_input();
             ephyrClientKey(event_type,state, key);
             //send key release immeidately after key press to avoid "key sticking"
             ephyrClientKey(KeyRelease,state, key);
@@ -2774,6 +3765,7 @@ BOOL remote_process_client_event ( char* buff , int length)
             uint32_t state=*((uint32_t*)buff+1);
             uint32_t key=*((uint32_t*)buff+2);
             //                    EPHYR_DBG("HAVE KEY RELEASE EVENT state: %d(%x), key: %d(%x) from client\n",state,state, key, key);
+            remote_input_received((remoteVars.client_version>=12)?*((uint32_t*)buff+3):0);
             ephyrClientKey(event_type,state, key);
             break;
         }
@@ -2829,7 +3821,8 @@ BOOL remote_process_client_event ( char* buff , int length)
         }
         case SELECTIONEVENT:
         {
-            readInputSelectionHeader(buff);
+            //framed event can have complete chunk, the rest of short event is not the data of chunk
+            readInputSelectionHeader(buff, length);
             break;
         }
         case CLIENTVERSION:
@@ -2855,7 +3848,26 @@ BOOL remote_process_client_event ( char* buff , int length)
         }
         case RESENDFRAME:
         {
-            resend_frame( *((uint32_t*)buff+1) );
+            if(remoteVars.send_frames_over_udp)
+            {
+                //frame packet was lost, used to choose amount of parity dgrams
+                ++remoteVars.udpLostPackets;
+            }
+            add_resend_request( *((uint32_t*)buff+1), 0, 0, NULL);
+            break;
+        }
+        case RESENDDGRAMS:
+        {
+            //2B packet seq + 2B amount of dgrams + 2B for every dgram number
+            uint16_t seq=*((uint16_t*)buff+2);
+            uint16_t count=*((uint16_t*)buff+3);
+            if(!count)
+                break;
+            if(remoteVars.send_frames_over_udp)
+            {
+                ++remoteVars.udpLostPackets;
+            }
+            add_resend_request(0, seq, count, (uint16_t*)buff+4);
             break;
         }
         case CACHEREBUILD:
@@ -2880,6 +3892,24 @@ BOOL remote_process_client_event ( char* buff , int length)
             open_udp_socket();
             break;
         }
+        case MTUPROBEACK:
+        {
+            //2B probe id + 2B size of probe dgram
+            process_mtu_probe_ack(*((uint16_t*)buff+2), *((uint16_t*)buff+3));
+            break;
+        }
+        case EVPROTOCOL:
+        {
+            uint16_t ver=*((uint16_t*)buff+2);
+            if(ver > EVPROTOCOL_VERSION || !ver)
+            {
+                EPHYR_DBG("Unsupported version of event protocol %d", ver);
+                return FALSE;
+            }
+            EPHYR_DBG("Client is sending framed events, version %d", ver);
+            remoteVars.framedEvents=TRUE;
+            break;
+        }
         default:
         {
             EPHYR_DBG("UNSUPPORTED EVENT: %d",event_type);
@@ -2889,13 +3919,34 @@ BOOL remote_process_client_event ( char* buff , int length)
     return TRUE;
 }
 
+/*
+ * get position and length of the next complete event in event buffer.
+ * Returns FALSE if the event is not received completely yet
+ */
+static
+BOOL next_client_event(uint32_t pos, uint32_t length, uint32_t* evPos, uint32_t* evLength)
+{
+    if(!remoteVars.framedEvents)
+    {
+        *evPos=pos;
+        *evLength=EVLENGTH;
+        return (length-pos >= EVLENGTH);
+    }
+    if(length-pos < EVFRAMEHEADERSIZE)
+        return FALSE;
+    *evPos=pos+EVFRAMEHEADERSIZE;
+    *evLength=*((uint32_t*)(remoteVars.eventBuffer+pos));
+    return (length-*evPos >= *evLength);
+}
+
 void
 clientReadNotify(int fd, int ready, void *data)
 {
     BOOL con;
     int length = 0;
-    int iterations = 0;
-    int restDataLength, restDataPos = 0;
+    uint32_t pos = 0;
+    uint32_t evPos, evLength;
+    uint32_t nextPos, nextLength;
 
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
     con=remoteVars.client_connected;
@@ -2905,8 +3956,9 @@ clientReadNotify(int fd, int ready, void *data)
     if(!con)
         return;
 
-    /* read max 99 events */
-    length=read(remoteVars.clientsock_tcp,remoteVars.eventBuffer + remoteVars.evBufferOffset, EVLENGTH*99);
+    /* read as much events as fit in buffer */
+    length=read(remoteVars.clientsock_tcp,remoteVars.eventBuffer + remoteVars.evBufferOffset,
+                remoteVars.eventBufferSize - remoteVars.evBufferOffset);
 
     if(length<0)
     {
@@ -2923,34 +3975,78 @@ clientReadNotify(int fd, int ready, void *data)
 //    EPHYR_DBG("Got ev bytes - %d\n",eventnum++);
 
     length+=remoteVars.evBufferOffset;
-    iterations=length/EVLENGTH;
 
-    for(int i=0;i<iterations;++i)
+    //process events in place, only the incomplete event at the end is moved to the beginning of buffer
+    while(next_client_event(pos, length, &evPos, &evLength))
     {
-        char* buff=remoteVars.eventBuffer+i*EVLENGTH;
+        char* buff=remoteVars.eventBuffer+evPos;
+        char shortEvent[EVLENGTH];
 
-        // if(remoteVars.selstruct.readingInputBuffer != -1)
-        // {
-        //     readInputSelectionBuffer(buff);
-        // }
-        // else
+        if(remoteVars.framedEvents && (evLength < 4 || evLength > EVMAXFRAMEDLENGTH))
         {
-            if(!remote_process_client_event(buff,0))
-            {
-                /* looks like we have some corrupted data, let's try to reset event buffer */
-                remoteVars.evBufferOffset=0;
-                length=0;
-            }
+            EPHYR_DBG("Wrong length of framed event %d", evLength);
+            /* looks like we have some corrupted data, let's try to reset event buffer */
+            length=pos=0;
+            break;
+        }
+
+        //collapse consecutive motion events to the latest position,
+        //events of other types are keeping their order relative to motion
+        if(!remoteVars.motionHistory && *((uint32_t*)buff) == MotionNotify &&
+           next_client_event(evPos+evLength, length, &nextPos, &nextLength) && nextLength >= 4 &&
+           *((uint32_t*)(remoteVars.eventBuffer+nextPos)) == MotionNotify)
+        {
+            pos=evPos+evLength;
+            continue;
+        }
+
+        if(evLength < EVLENGTH)
+        {
+            //short framed event, handlers are expecting zeros in the rest of event
+            memset(shortEvent, 0, EVLENGTH);
+            memcpy(shortEvent, buff, evLength);
+            buff=shortEvent;
+        }
+
+        pos=evPos+evLength;
+        if(!remote_process_client_event(buff,evLength))
+        {
+            /* looks like we have some corrupted data, let's try to reset event buffer */
+            length=pos=0;
+            break;
         }
 //        EPHYR_DBG("Processed event - %d %d\n",eventnum++, eventbytes);
     }
-    restDataLength=length%EVLENGTH;
-    restDataPos=length-restDataLength;
 
-    if(restDataLength)
-       memcpy(remoteVars.eventBuffer, remoteVars.eventBuffer+restDataPos, restDataLength);
-    remoteVars.evBufferOffset=restDataLength;
+    if(pos && length-pos)
+       memmove(remoteVars.eventBuffer, remoteVars.eventBuffer+pos, length-pos);
+    remoteVars.evBufferOffset=length-pos;
 
+    //make sure the next framed event will fit in the buffer
+    if(remoteVars.framedEvents && remoteVars.evBufferOffset >= EVFRAMEHEADERSIZE)
+    {
+        evLength=*((uint32_t*)remoteVars.eventBuffer);
+        if(evLength < 4 || evLength > EVMAXFRAMEDLENGTH)
+        {
+            EPHYR_DBG("Wrong length of framed event %d", evLength);
+            remoteVars.evBufferOffset=0;
+        }
+        else if(evLength+EVFRAMEHEADERSIZE > remoteVars.eventBufferSize)
+        {
+            char* newBuffer=realloc(remoteVars.eventBuffer, evLength+EVFRAMEHEADERSIZE+EVLENGTH*100);
+            if(!newBuffer)
+            {
+                //keep the old buffer and drop the event, like corrupted data
+                EPHYR_DBG("failed to allocate buffer for framed event of %d bytes", evLength);
+                remoteVars.evBufferOffset=0;
+            }
+            else
+            {
+                remoteVars.eventBuffer=newBuffer;
+                remoteVars.eventBufferSize=evLength+EVFRAMEHEADERSIZE+EVLENGTH*100;
+            }
+        }
+    }
 }
 
 #define SubSend(pWin) \
@@ -3054,7 +4150,7 @@ void client_win_change(char* buff)
     uint16_t nh=*((int16_t*)(buff+18));
     uint8_t focus=*((int8_t*)(buff+20));
     uint8_t newstate=*((int8_t*)(buff+21));
-    BOOL move=FALSE, resize=FALSE, restack=FALSE;
+    BOOL move=FALSE, resize=FALSE, restack=FALSE, repaint=FALSE;
 
 //     EPHYR_DBG("Client request win change: %p %d:%d %dx%d",fptr, nx,ny,nw,nh);
     pWin=remote_find_window_on_screen_by_id(winId, remoteVars.ephyrScreen->pScreen->root);
@@ -3071,6 +4167,14 @@ void client_win_change(char* buff)
     }
     if(newstate==WIN_ICONIFIED)
     {
+        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+        rw=remote_find_window(pWin);
+        if(rw)
+        {
+            //if nobody unmaps the window, stop sending it's damage till client shows it again
+            rw->clientHidden=TRUE;
+        }
+        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
         client_win_iconify(winId);
         ReflectStackChange(pWin, 0, VTOther);
         return;
@@ -3134,8 +4238,9 @@ void client_win_change(char* buff)
     {
         if(rw)
         {
-            rw->x=nx;
-            rw->y=ny;
+            //client already has the new position, changes are sent relative to it
+            rw->x=rw->sent.x=nx;
+            rw->y=rw->sent.y=ny;
         }
         move=TRUE;
     }
@@ -3143,8 +4248,8 @@ void client_win_change(char* buff)
     {
         if(rw)
         {
-            rw->w=nw;
-            rw->h=nh;
+            rw->w=rw->sent.w=nw;
+            rw->h=rw->sent.h=nh;
         }
         resize=TRUE;
     }
@@ -3159,8 +4264,16 @@ void client_win_change(char* buff)
         {
             rw->nextSibId=0;
         }
+        rw->sent.nextSibId=rw->nextSibId;
         restack=TRUE;
     }
+    if(rw->clientHidden)
+    {
+        //client shows the window again
+        rw->clientHidden=FALSE;
+        repaint=rw->damageDeferred;
+        rw->damageDeferred=FALSE;
+    }
     pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
     if(move)
     {
@@ -3186,6 +4299,34 @@ void client_win_change(char* buff)
             SetInputFocus(wClient(pWin), inputInfo.keyboard, pWin->drawable.id,  RevertToParent, CurrentTime, TRUE);
         }
     }
+    if(repaint)
+    {
+        //send the damage which was deferred while window was hidden, including the frame of window manager
+        WindowPtr pTop=pWin;
+        int32_t rx, ry, rwidth, rheight;
+        while(pTop->parent && pTop->parent->parent)
+            pTop=pTop->parent;
+        rx=pTop->drawable.x-pTop->borderWidth;
+        ry=pTop->drawable.y-pTop->borderWidth;
+        rwidth=pTop->drawable.width+2*pTop->borderWidth;
+        rheight=pTop->drawable.height+2*pTop->borderWidth;
+        if(rx<0)
+        {
+            rwidth+=rx;
+            rx=0;
+        }
+        if(ry<0)
+        {
+            rheight+=ry;
+            ry=0;
+        }
+        if(rx+rwidth > (int32_t)remoteVars.main_img_width)
+            rwidth=remoteVars.main_img_width-rx;
+        if(ry+rheight > (int32_t)remoteVars.main_img_height)
+            rheight=remoteVars.main_img_height-ry;
+        if(rwidth>0 && rheight>0)
+            add_frame(rwidth, rheight, rx, ry, 0, 0, 0);
+    }
 }
 
 void set_client_version(uint16_t ver, uint16_t os)
@@ -3273,13 +4414,51 @@ unsigned int checkSocketConnection(OsTimerPtr timer, CARD32 time, void* args)
     return 0;
 }
 
-void serverAcceptNotify(int fd, int ready_sock, void *data)
+/*
+ * read 32 bytes of cookie from new connection and compare it with our cookie
+ */
+static
+BOOL read_client_cookie(int sock)
 {
-    int ret;
     char msg[33];
     int length=32;
     int ready=0;
 
+    if(!strlen(remoteVars.cookie))
+    {
+        EPHYR_DBG("Warning: not checking client's cookie");
+        return TRUE;
+    }
+    while(ready<length)
+    {
+        int chunk=read(sock, msg+ready, 32-ready);
+        if(chunk<=0)
+        {
+            EPHYR_DBG("READ COOKIE ERROR");
+            return FALSE;
+        }
+        ready+=chunk;
+    }
+    EPHYR_DBG("got %d COOKIE BYTES from client", ready);
+    if(strncmp(msg,remoteVars.cookie,32))
+    {
+        EPHYR_DBG("Wrong cookie");
+        return FALSE;
+    }
+    EPHYR_DBG("Cookie approved");
+    return TRUE;
+}
+
+void serverAcceptNotify(int fd, int ready_sock, void *data)
+{
+    int ret;
+
+    if(remoteVars.client_connected)
+    {
+        //client is already connected, new connection is a viewer
+        accept_viewer();
+        return;
+    }
 
     remoteVars.clientsock_tcp = accept ( remoteVars.serversock_tcp, (struct sockaddr *) &remoteVars.tcp_address, &remoteVars.tcp_addrlen);
     if (remoteVars.clientsock_tcp <= 0)
@@ -3289,8 +4468,9 @@ void serverAcceptNotify(int fd, int ready_sock, void *data)
     }
     EPHYR_DBG ("Connection from (%s)...\n", inet_ntoa (remoteVars.tcp_address.sin_addr));
 
-    //only accept one client, close server socket
-    close_server_socket();
+    //only accept one client, close server socket if viewers are not allowed
+    if(!remoteVars.maxViewers)
+        close_server_socket();
 
     if(strlen(remoteVars.acceptAddr))
     {
@@ -3315,36 +4495,14 @@ void serverAcceptNotify(int fd, int ready_sock, void *data)
         //     return;
         // }
     }
-    if(strlen(remoteVars.cookie))
+    if(!read_client_cookie(remoteVars.clientsock_tcp))
     {
-        while(ready<length)
-        {
-            int chunk=read(remoteVars.clientsock_tcp, msg+ready, 32-ready);
-            if(chunk<=0)
-            {
-                EPHYR_DBG("READ COOKIE ERROR");
-                close_client_sockets();
-                return;
-            }
-            ready+=chunk;
-        }
+        close_client_sockets();
+        return;
     }
 
-    if(strlen(remoteVars.cookie))
-    {
-        EPHYR_DBG("got %d COOKIE BYTES from client", ready);
-        if(strncmp(msg,remoteVars.cookie,32))
-        {
-            EPHYR_DBG("Wrong cookie");
-            close_client_sockets();
-            return;
-        }
-        EPHYR_DBG("Cookie approved");
-    }
-    else
-    {
-        EPHYR_DBG("Warning: not checking client's cookie");
-    }
+    //from now on all writes to client socket are going through output buffer
+    start_output_flushing();
 
   if(remoteVars.compression == JPEG || remoteVars.compression == PNG){
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
@@ -3365,6 +4523,7 @@ void serverAcceptNotify(int fd, int ready_sock, void *data)
     remoteVars.data_sent=0;
     remoteVars.data_copy=0;
     remoteVars.evBufferOffset=0;
+    remoteVars.framedEvents=FALSE;
     setAgentState(RUNNING);
 
     pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
@@ -3387,6 +4546,7 @@ void serverAcceptNotify(int fd, int ready_sock, void *data)
     remoteVars.data_sent=0;
     remoteVars.data_copy=0;
     remoteVars.evBufferOffset=0;
+    remoteVars.framedEvents=FALSE;
     setAgentState(RUNNING);
 
   }
@@ -3485,6 +4645,11 @@ open_udp_socket(void)
                 {
                     //we are connected, return from function
                     EPHYR_DBG("Connected to client UDP socket...");
+                    //start with default dgram size, bigger size is used after client acknowledged it
+                    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+                    start_mtu_probing();
+                    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+                    reset_udp_pacing();
                     remoteVars.send_frames_over_udp=TRUE;
                     return;
                 }
@@ -3549,6 +4714,8 @@ void open_socket(void)
 
 void terminateServer(int exitStatus)
 {
+    int i;
+
     setAgentState(TERMINATING);
     if(remoteVars.client_connected)
     {
@@ -3561,6 +4728,10 @@ void terminateServer(int exitStatus)
     {
         pthread_cancel(remoteVars.send_thread_id);
     }
+    if(remoteVars.viewers_flush_thread_id)
+    {
+        pthread_cancel(remoteVars.viewers_flush_thread_id);
+    }
     if(remoteVars.selstruct.selThreadId)
     {
         pthread_cancel(remoteVars.selstruct.selThreadId);
@@ -3574,7 +4745,17 @@ void terminateServer(int exitStatus)
 
     pthread_mutex_destroy(&remoteVars.mainimg_mutex);
     pthread_mutex_destroy(&remoteVars.sendqueue_mutex);
+    pthread_mutex_destroy(&remoteVars.cache_mutex);
+    pthread_mutex_destroy(&remoteVars.cursor_mutex);
+    pthread_mutex_destroy(&remoteVars.selection_mutex);
     pthread_cond_destroy(&remoteVars.have_sendqueue_cond);
+    pthread_mutex_destroy(&remoteVars.outbuf_mutex);
+    pthread_cond_destroy(&remoteVars.outbuf_cond);
+    pthread_cond_destroy(&remoteVars.viewers_cond);
+    free(remoteVars.outbuf.data);
+    for(i=0;i<MAXVIEWERS;++i)
+        free(remoteVars.viewers[i].outbuf.data);
+    free(remoteVars.eventBuffer);
 
     if(remoteVars.main_img)
     {
@@ -3585,14 +4766,8 @@ void terminateServer(int exitStatus)
     }
 
 
-    if(remoteVars.selstruct.inSelection[0].data)
-    {
-        free(remoteVars.selstruct.inSelection[0].data);
-    }
-    if(remoteVars.selstruct.inSelection[1].data)
-    {
-        free(remoteVars.selstruct.inSelection[1].data);
-    }
+    free_selection_buffer(&remoteVars.selstruct.inSelection[0]);
+    free_selection_buffer(&remoteVars.selstruct.inSelection[1]);
     setAgentState(TERMINATED);
     EPHYR_DBG("exit program with status %d", exitStatus);
 
@@ -3667,12 +4842,42 @@ void processConfigFileSetting(char* key, char* value)
         sscanf(value, "%d",&remoteVars.udpPort);
         EPHYR_DBG("listen %d", remoteVars.udpPort);
     }
-    else if(!strcmp(key, "clipboard"))
+    else if(!strcmp(key, "latencystats"))
     {
-        if(!strcmp(value,"client"))
-        {
-            remoteVars.selstruct.selectionMode=CLIP_CLIENT;
-            EPHYR_DBG("CLIPBOARD MODE: client");
+        strncpy(remoteVars.latencyFile, value, 255);
+        remoteVars.latencyFile[255]=0;
+        EPHYR_DBG("latency stats file %s", remoteVars.latencyFile);
+    }
+    else if(!strcmp(key, "inputboost"))
+    {
+        //0 - don't boost frames after input, 1 - send them first, 2 - send them first and compress faster
+        int boost=atoi(value);
+        if(boost <= 0)
+            remoteVars.inputBoost=BOOST_NONE;
+        else if(boost == 1)
+            remoteVars.inputBoost=BOOST_ON;
+        else
+            remoteVars.inputBoost=BOOST_FAST;
+        EPHYR_DBG("input boost %d", remoteVars.inputBoost);
+    }
+    else if(!strcmp(key, "winupdaterate"))
+    {
+        //0 - send every move or resize of window immediately
+        int rate=atoi(value);
+        remoteVars.winUpdateInterval=(rate>0)?1000/rate:0;
+        EPHYR_DBG("window update rate %d", rate);
+    }
+    else if(!strcmp(key, "motionhistory"))
+    {
+        remoteVars.motionHistory=(atoi(value) != 0);
+        EPHYR_DBG("motion history %d", remoteVars.motionHistory);
+    }
+    else if(!strcmp(key, "clipboard"))
+    {
+        if(!strcmp(value,"client"))
+        {
+            remoteVars.selstruct.selectionMode=CLIP_CLIENT;
+            EPHYR_DBG("CLIPBOARD MODE: client");
         }
         else if(!strcmp(value,"server"))
         {
@@ -3690,6 +4895,80 @@ void processConfigFileSetting(char* key, char* value)
             EPHYR_DBG("CLIPBOARD MODE: disabled");
         }
     }
+    else if(!strcmp(key, "selcompression"))
+    {
+        //zlib level 1-9 for text selections, 0 - don't compress
+        int level=atoi(value);
+        if(level<0)
+            level=0;
+        if(level>Z_BEST_COMPRESSION)
+            level=Z_BEST_COMPRESSION;
+        remoteVars.selstruct.compressionLevel=level;
+        EPHYR_DBG("selection compression level %d", level);
+    }
+    else if(!strcmp(key, "viewers"))
+    {
+        //amount of view only connections allowed in addition to client, 0 - don't accept viewers
+        int viewers=atoi(value);
+        if(viewers<0)
+            viewers=0;
+        if(viewers>MAXVIEWERS)
+            viewers=MAXVIEWERS;
+        remoteVars.maxViewers=viewers;
+        EPHYR_DBG("accepting up to %d viewers", viewers);
+    }
+    else if(!strcmp(key, "selwindow"))
+    {
+        //size in MB, incoming selections bigger than this are stored in temporary file, 0 - keep them in memory
+        int mb=atoi(value);
+        if(mb<0)
+            mb=0;
+        if(mb>1024)
+            mb=1024;
+        remoteVars.selstruct.spoolWindow=mb*1024*1024;
+        EPHYR_DBG("selection spool window %d MB", mb);
+    }
+    else if(!strcmp(key, "fec"))
+    {
+        //0 - don't send parity dgrams, 1 - choose amount of parity dgrams from packet loss,
+        //N - send one parity dgram for every N dgrams
+        int group=1;
+        sscanf(value, "%d", &group);
+        if(group <= 0)
+        {
+            remoteVars.fecMode=FEC_NONE;
+            remoteVars.fecGroupSize=0;
+        }
+        else if(group == 1)
+        {
+            remoteVars.fecMode=FEC_ADAPTIVE;
+            remoteVars.fecGroupSize=0;
+        }
+        else
+        {
+            remoteVars.fecMode=FEC_FIXED;
+            remoteVars.fecGroupSize=(group>FECMAXGROUP)?FECMAXGROUP:group;
+        }
+        EPHYR_DBG("fec %d", group);
+    }
+    else if(!strcmp(key, "sendweights"))
+    {
+        //cursor:frame:refine:selection:bulk
+        uint32_t weights[SEND_CLASSES];
+        if(sscanf(value, "%u:%u:%u:%u:%u", &weights[SEND_CURSOR], &weights[SEND_FRAME], &weights[SEND_REFINE],
+                  &weights[SEND_SELECTION], &weights[SEND_BULK]) == SEND_CLASSES)
+        {
+            for(int i=0;i<SEND_CLASSES;++i)
+            {
+                remoteVars.sendWeight[i]=weights[i]?weights[i]:1;
+            }
+            EPHYR_DBG("send weights %s", value);
+        }
+        else
+        {
+            EPHYR_DBG("wrong value for send weights %s, using defaults", value);
+        }
+    }
 }
 
 void readOptionsFromFile(void)
@@ -3751,6 +5030,11 @@ remote_init(void)
     fclose(stdin);
 
     remoteVars.serversock_tcp=remoteVars.sock_udp=-1;
+    remoteVars.udpDgramSize=remoteVars.udpConfirmedSize=UDPDGRAMSIZE;
+    remoteVars.fecMode=FEC_ADAPTIVE;
+    remoteVars.inputBoost=BOOST_ON;
+    remoteVars.windowsFullCheck=TRUE;
+    remoteVars.winUpdateInterval=1000/WINUPDATE_RATE;
 
     if(!remoteVars.initialJpegQuality)
         remoteVars.initialJpegQuality=remoteVars.jpegQuality=JPG_QUALITY;
@@ -3758,6 +5042,14 @@ remote_init(void)
     remoteVars.compression=DEFAULT_COMPRESSION;
 
     remoteVars.selstruct.selectionMode = CLIP_BOTH;
+    remoteVars.selstruct.compressionLevel = SELECTION_COMPRESSION_LEVEL;
+    remoteVars.selstruct.spoolWindow = SELECTION_SPOOL_WINDOW;
+
+    remoteVars.sendWeight[SEND_CURSOR]=CURSOR_WEIGHT;
+    remoteVars.sendWeight[SEND_FRAME]=FRAME_WEIGHT;
+    remoteVars.sendWeight[SEND_REFINE]=REFINE_WEIGHT;
+    remoteVars.sendWeight[SEND_SELECTION]=SELECTION_WEIGHT;
+    remoteVars.sendWeight[SEND_BULK]=BULK_WEIGHT;
 
     if(!strlen(remote_get_init_geometry()))
     {
@@ -3767,7 +5059,17 @@ remote_init(void)
 
     pthread_mutex_init(&remoteVars.mainimg_mutex, NULL);
     pthread_mutex_init(&remoteVars.sendqueue_mutex,NULL);
+    pthread_mutex_init(&remoteVars.cache_mutex,NULL);
+    pthread_mutex_init(&remoteVars.cursor_mutex,NULL);
+    pthread_mutex_init(&remoteVars.selection_mutex,NULL);
     pthread_cond_init(&remoteVars.have_sendqueue_cond,NULL);
+    pthread_mutex_init(&remoteVars.outbuf_mutex,NULL);
+    pthread_cond_init(&remoteVars.outbuf_cond,NULL);
+    pthread_cond_init(&remoteVars.viewers_cond,NULL);
+    remoteVars.eventBufferSize=EVLENGTH*100;
+    remoteVars.eventBuffer=malloc(remoteVars.eventBufferSize);
+    //no client connected yet
+    remoteVars.outbuf.closed=TRUE;
 
     displayVar=secure_getenv("DISPLAY");
 
@@ -4052,8 +5354,12 @@ struct cache_elem* find_cache_element(uint32_t crc)
     return 0;
 }
 
+/*
+ * find common regions with frames in cache and compress the frame.
+ * If fast is set, the frame is compressed as one region without searching the cache
+ */
 static
-void initFrameRegions(struct cache_elem* frame)
+void initFrameRegions(struct cache_elem* frame, BOOL fast)
 {
     BOOL haveMultplyRegions=FALSE;
     int32_t length=0;
@@ -4061,14 +5367,14 @@ void initFrameRegions(struct cache_elem* frame)
     struct frame_region* regions=frame->regions;
     BOOL diff;
 
-    if(frame->width>4 && frame->height>4 && frame->width * frame->height > 100 )
+    if(!fast && frame->width>4 && frame->height>4 && frame->width * frame->height > 100 )
     {
         unsigned int match_val = 0;
         uint32_t bestm_crc = 0;
         struct cache_elem* best_match = NULL;
 
 
-        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_lock(&remoteVars.cache_mutex);
         best_match = find_best_match(frame, &match_val);
 
         if(best_match)
@@ -4076,7 +5382,7 @@ void initFrameRegions(struct cache_elem* frame)
             best_match->busy+=1;
         }
 
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
 
         if(best_match && best_match->width>4 && best_match->height>4 && best_match->width * best_match->height > 100 )
         {
@@ -4189,14 +5495,14 @@ void initFrameRegions(struct cache_elem* frame)
         /* if we didn't find any common regions and have best match element, mark it as not busy */
 
 
-        pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_lock(&remoteVars.cache_mutex);
         if(best_match && frame->source != best_match)
         {
 //            EPHYR_DBG("Have best mutch but not common region");
             best_match->busy-=1;
         }
 
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
 
     }
 
@@ -4270,11 +5576,146 @@ void initFrameRegions(struct cache_elem* frame)
     frame->compressed_size=length;
 }
 
+/*
+ * check if the screen area of queue element is completely covered by the rectangle.
+ * Element with frame 0 and width 0 is the main image and covers the whole screen
+ */
+static
+BOOL queue_element_covered(struct sendqueue_element* element, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t winId)
+{
+    if(element->winId != winId)
+        return FALSE;
+
+    if(!width)
+    {
+        /* the rectangle is a main image */
+        return TRUE;
+    }
+
+    if(!element->frame && !element->width)
+    {
+        /* element is a main image and can be covered only by main image */
+        return FALSE;
+    }
+
+    return (element->x >= x && element->y >= y &&
+            element->x + element->width <= x + width &&
+            element->y + element->height <= y + height);
+}
+
+/*
+ * remove from the queue all not sent elements which will be overpainted by the new element.
+ * If the frame of removed element is not referenced from the queue anymore and not sent yet,
+ * release it's compressed regions. They will be created again if the frame will be requested later.
+ * The new element takes over the input reference of removed elements.
+ * warning! sendqueue_mutex and cache_mutex should be locked by thread calling this function!
+ */
+static
+void remove_covered_queue_elements(struct sendqueue_element* element)
+{
+    int32_t x=element->x, y=element->y;
+    uint32_t width=element->width, height=element->height, winId=element->winId;
+    struct sendqueue_element* current=remoteVars.first_sendqueue_element;
+    struct sendqueue_element* prev=NULL;
+    struct sendqueue_element* next=NULL;
+
+    while(current)
+    {
+        next=current->next;
+        if(!queue_element_covered(current, x, y, width, height, winId))
+        {
+            prev=current;
+            current=next;
+            continue;
+        }
+
+//        EPHYR_DBG("Drop covered element %dx%d, %d:%d", current->width, current->height, current->x, current->y);
+        if(current->inputTime && (!element->inputTime || current->inputTime < element->inputTime))
+        {
+            element->inputId=current->inputId;
+            element->inputTime=current->inputTime;
+            element->damageTime=current->damageTime;
+        }
+        if(prev)
+            prev->next=next;
+        else
+            remoteVars.first_sendqueue_element=next;
+        if(current==remoteVars.last_sendqueue_element)
+            remoteVars.last_sendqueue_element=prev;
+
+        if(current->frame)
+        {
+            if(current->frame->busy)
+                current->frame->busy--;
+            if(!current->frame->sent && !current->frame->busy)
+            {
+                release_frame_regions(current->frame);
+            }
+        }
+        free(current);
+        current=next;
+    }
+}
+
+/*
+ * check if the screen areas of two queue elements are overlapping.
+ * Element with frame 0 and width 0 is the main image and overlaps everything in the same window
+ */
+static
+BOOL queue_elements_intersect(struct sendqueue_element* first, struct sendqueue_element* second)
+{
+    if(first->winId != second->winId)
+        return FALSE;
+
+    if((!first->frame && !first->width) || (!second->frame && !second->width))
+        return TRUE;
+
+    return (first->x < second->x + (int32_t)second->width && second->x < first->x + (int32_t)first->width &&
+            first->y < second->y + (int32_t)second->height && second->y < first->y + (int32_t)first->height);
+}
+
+/*
+ * add element caused by recent input to the queue. It's going before the elements which are not boosted,
+ * but after the elements which are overlapping with it, otherwise the client will paint them in wrong order.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+void insert_boosted_queue_element(struct sendqueue_element* element)
+{
+    struct sendqueue_element* current=remoteVars.first_sendqueue_element;
+    struct sendqueue_element* prev=NULL;
+
+    //element can't go before the last element overlapping with it or before other boosted elements
+    while(current)
+    {
+        if(current->boosted || queue_elements_intersect(current, element))
+            prev=current;
+        current=current->next;
+    }
+
+    if(!prev)
+    {
+        element->next=remoteVars.first_sendqueue_element;
+        remoteVars.first_sendqueue_element=element;
+    }
+    else
+    {
+        element->next=prev->next;
+        prev->next=element;
+    }
+    if(!element->next)
+        remoteVars.last_sendqueue_element=element;
+}
+
 void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t crc, uint32_t size, uint32_t winId)
 {
     Bool isNewElement = FALSE;
     struct cache_elem* frame = 0;
     struct sendqueue_element* element = NULL;
+    uint64_t damageTime=remote_time_usec();
+    uint32_t inputId=0;
+    uint64_t inputTime=0;
+    BOOL boosted=remote_input_boost_active();
 
 
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
@@ -4285,15 +5726,22 @@ void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t c
         return;
     }
 
-    if(crc==0)
-    {
-        /* sending main image */
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
 
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
-    }
-    else
+    //first frame after input is carrying the reference to it
+    if(remoteVars.pendingInputTime)
     {
+        if(damageTime-remoteVars.pendingInputTime < LATENCY_INPUT_TIMEOUT*1000)
+        {
+            inputId=remoteVars.pendingInputId;
+            inputTime=remoteVars.pendingInputTime;
+        }
+        remoteVars.pendingInputTime=0;
+    }
 
+    if(crc!=0)
+    {
+        pthread_mutex_lock(&remoteVars.cache_mutex);
         frame=find_cache_element(crc);
         if(!frame)
         {
@@ -4301,6 +5749,13 @@ void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t c
             frame=add_cache_element(crc, x, y, size, width, height);
             isNewElement=TRUE;
         }
+        else if(!frame->sent && !frame->busy)
+        {
+            /* frame was dropped from the queue before sending, client doesn't have it, compress it again */
+//            EPHYR_DBG("ADD DROPPED FRAME %x",crc);
+            release_frame_regions(frame);
+            isNewElement=TRUE;
+        }
         else
         {
 //            EPHYR_DBG("ADD EXISTING FRAME %x",crc);
@@ -4308,19 +5763,17 @@ void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t c
         frame->busy+=1;
 
 
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
 
         /* if element is new find common regions and compress the data */
         if(isNewElement)
         {
-            /* find bestmatch and lock it */
-            initFrameRegions(frame);
+            /* find bestmatch and lock it, user is waiting for the boosted frame, don't search if it should be fast */
+            initFrameRegions(frame, boosted && remoteVars.inputBoost == BOOST_FAST);
         }
     }
 
 
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-    /* add element in the queue for sending */
     element=malloc(sizeof(struct sendqueue_element));
     element->frame=frame;
     element->next=NULL;
@@ -4329,7 +5782,28 @@ void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t c
     element->width=width;
     element->height=height;
     element->winId=winId;
-    if(remoteVars.last_sendqueue_element)
+    element->inputId=inputId;
+    element->inputTime=inputTime;
+    element->damageTime=damageTime;
+    element->queueTime=remote_time_usec();
+    element->boosted=boosted;
+
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    /* latest wins: don't send the elements which will be overpainted by this one */
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    remove_covered_queue_elements(element);
+    if(inputTime)
+    {
+        record_latency(LAT_DAMAGE, inputTime, damageTime);
+    }
+    record_latency(LAT_ENCODE, damageTime, element->queueTime);
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+    /* add element in the queue for sending */
+    if(boosted)
+    {
+        insert_boosted_queue_element(element);
+    }
+    else if(remoteVars.last_sendqueue_element)
     {
         remoteVars.last_sendqueue_element->next=element;
         remoteVars.last_sendqueue_element=element;
@@ -4352,7 +5826,7 @@ void remote_send_main_image(void)
 
 struct remoteWindow* remote_find_window(WindowPtr win)
 {
-    struct remoteWindow* rw=remoteVars.windowList;
+    struct remoteWindow* rw=remoteVars.windowHash[remote_window_hash(win)];
 //     EPHYR_DBG("LOOK for %p in list",win);
     while(rw)
     {
@@ -4360,7 +5834,7 @@ struct remoteWindow* remote_find_window(WindowPtr win)
         {
             return rw;
         }
-        rw=rw->next;
+        rw=rw->hashNext;
     }
 //     EPHYR_DBG("WINDOW %p not found in list",win);
     return NULL;
@@ -4378,6 +5852,7 @@ void remote_check_window(WindowPtr win)
     BOOL hasFocus=FALSE;
     struct remoteWindow* rwin;
     uint32_t transWinId=0;
+    uint32_t iconCrc=0;
     uint8_t winType=WINDOW_TYPE_NORMAL;
     int16_t x,y,i, minw=0, minh=0;
     uint16_t w,h,bw;
@@ -4626,18 +6101,18 @@ void remote_check_window(WindowPtr win)
         rwin->ptr=win;
         rwin->next=remoteVars.windowList;
         remoteVars.windowList=rwin;
+        rwin->hashNext=remoteVars.windowHash[remote_window_hash(win)];
+        remoteVars.windowHash[remote_window_hash(win)]=rwin;
         rwin->name=NULL;
         rwin->icon_png=NULL;
         rwin->icon_size=0;
+        rwin->nameCrc=rwin->iconCrc=0;
+        rwin->sendName=rwin->sendIcon=FALSE;
+        rwin->known=FALSE;
+        rwin->clientHidden=rwin->damageDeferred=FALSE;
+        memset(&(rwin->sent), 0, sizeof(rwin->sent));
         rwin->minw=minw;
         rwin->minh=minh;
-        if(max_icon_w && (winType==WINDOW_TYPE_NORMAL || winType==WINDOW_TYPE_DIALOG))
-        {
-            rwin->icon_png=png_compress( max_icon_w, max_icon_h,
-                                         icon_data, &rwin->icon_size, TRUE);
-        }
-        else
-            max_icon_w=0;
 
 
 //         EPHYR_DBG("Add to list: ID 0x%X, type %d, %s, %d:%d %dx%d, visibility: %d", win->drawable.id, winType, rwin->name, x,y,
@@ -4648,6 +6123,13 @@ void remote_check_window(WindowPtr win)
 //         EPHYR_DBG("found in list: %p, %s, %d:%d %dx%d, visibility: %d", rwin->ptr, rwin->name, rwin->x,rwin->y,
 //                     rwin->w, rwin->h,rwin->visibility);
 
+        //window is back before client got the delete notification, it will be repainted after mapping
+        if(rwin->state == WDEL)
+        {
+            rwin->state=CHANGED;
+            rwin->clientHidden=rwin->damageDeferred=FALSE;
+        }
+
         if(rwin->name || dispName)
         {
             if(rwin->name==NULL && dispName)
@@ -4685,6 +6167,31 @@ void remote_check_window(WindowPtr win)
 
     rwin->hasFocus=hasFocus;
 
+    //icon is compressed only if it's changed, compressed icon is kept to send it again if client dropped it
+    if(max_icon_w && (winType==WINDOW_TYPE_NORMAL || winType==WINDOW_TYPE_DIALOG))
+    {
+        iconCrc=crc32(crc32(0L, Z_NULL, 0), icon_data, max_icon_w*max_icon_h*4);
+    }
+    if(iconCrc != rwin->iconCrc)
+    {
+        if(rwin->icon_png)
+        {
+            free(rwin->icon_png);
+            rwin->icon_png=NULL;
+            rwin->icon_size=0;
+        }
+        rwin->iconCrc=iconCrc;
+        if(iconCrc)
+        {
+            rwin->icon_png=png_compress( max_icon_w, max_icon_h,
+                                         icon_data, &rwin->icon_size, TRUE);
+        }
+        if(rwin->state != NEW)
+        {
+            rwin->state=CHANGED;
+        }
+    }
+
 
     rwin->foundInWinTree=TRUE;
     rwin->x=x;
@@ -4714,11 +6221,13 @@ void remote_check_window(WindowPtr win)
             free(rwin->name);
             rwin->name=NULL;
         }
+        rwin->nameCrc=0;
         if(dispNameSize)
         {
             rwin->name=malloc(dispNameSize+1);
             strncpy(rwin->name, dispName, dispNameSize);
             rwin->name[dispNameSize]='\0';
+            rwin->nameCrc=crc32(crc32(0L, Z_NULL, 0), (unsigned char*)rwin->name, dispNameSize);
         }
     }
     if(rwin->state != UNCHANGED)
@@ -4814,93 +6323,307 @@ WindowPtr remote_find_window_on_screen(WindowPtr win, WindowPtr root)
     return NULL;
 }
 
-void remote_check_rootless_windows_for_updates(KdScreenInfo *screen)
+/*
+ * check one window and mark it as deleted if it's not shown anymore.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+void remote_recheck_window(WindowPtr win)
 {
-    struct remoteWindow* rwin;
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-
-    //don't check windows if no client is connected
-    if(remoteVars.client_connected==FALSE)
+    struct remoteWindow* rwin=remote_find_window(win);
+    if(rwin)
+    {
+        rwin->foundInWinTree=FALSE;
+    }
+    remote_check_window(win);
+    rwin=remote_find_window(win);
+    if(!rwin)
     {
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
         return;
     }
-
-    //         EPHYR_DBG("START TREE CHECK");
-    remote_check_windowstree(screen->pScreen->root);
-
-    //check all windows in list and mark as deleted if not found in the tree
-    rwin=remoteVars.windowList;
-    while(rwin)
+    if(!rwin->foundInWinTree && rwin->state != WDEL)
     {
-        if(!rwin->foundInWinTree)
-        {
-            remoteVars.windowsUpdated=TRUE;
-            //mark window as deleted
-            rwin->state=WDEL;
-//             EPHYR_DBG("DELETED WINDOW:  %p, %s",rwin->ptr, rwin->name);
-        }
-        rwin->foundInWinTree=FALSE;
-        rwin=rwin->next;
+        remoteVars.windowsUpdated=TRUE;
+        rwin->state=WDEL;
+//         EPHYR_DBG("DELETED WINDOW:  %p, %s",rwin->ptr, rwin->name);
     }
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    rwin->foundInWinTree=FALSE;
 }
 
-//check if the point belongs to region. If the point is close enough, but not inside of region, extend the region boundaries
-BOOL
-insideOfRegion(struct PaintRectRegion* reg, int x , int y)
+/*
+ * remember window which should be checked on next update.
+ * Called by main thread from the hooks of X server
+ */
+static
+void remote_add_dirty_window(WindowPtr win, BOOL children)
 {
-    if(!reg)
-        return FALSE;
-    if(x >= reg->x1 - MAXDISTANCETOREGION && x <= reg->x2+MAXDISTANCETOREGION  &&  y >= reg->y1 - MAXDISTANCETOREGION && y<= reg->y2 + MAXDISTANCETOREGION)
+    int i;
+    if(!remoteVars.rootless || !win || remoteVars.windowsFullCheck)
+        return;
+    //root window itself is never sent to client
+    if(!win->parent && !children)
+        return;
+    for(i=0;i<remoteVars.dirtyWindowsCount;++i)
     {
-        if(x<reg->x1)
-            reg->x1=x;
-        if(x>reg->x2)
-            reg->x2=x;
-        if(y<reg->y1)
-            reg->y1=y;
-        if(y>reg->y2)
-            reg->y2=y;
-        return TRUE;
+        if(remoteVars.dirtyWindows[i].win == win && remoteVars.dirtyWindows[i].children == children)
+            return;
     }
-    return FALSE;
+    if(remoteVars.dirtyWindowsCount == DIRTYWINDOWS_MAX)
+    {
+        //too many changes, it's cheaper to check the whole tree
+        remoteVars.windowsFullCheck=TRUE;
+        remoteVars.dirtyWindowsCount=0;
+        return;
+    }
+    remoteVars.dirtyWindows[remoteVars.dirtyWindowsCount].win=win;
+    remoteVars.dirtyWindows[remoteVars.dirtyWindowsCount++].children=children;
 }
 
-//find the region, point belongs to
-struct PaintRectRegion*
-findRegionForPoint(struct PaintRectRegion* firstRegion, int x , int y)
+//geometry, visibility or properties of window are changed
+void remote_window_changed(WindowPtr win)
 {
-    while(firstRegion)
-    {
-        if(insideOfRegion(firstRegion, x,y))
-            return firstRegion;
-        firstRegion=firstRegion->next;
-    }
-    return firstRegion;
+    remote_add_dirty_window(win, FALSE);
 }
 
-BOOL
-unitePaintRegions(struct PaintRectRegion* firstRegion)
+//children of window are mapped, unmapped or restacked, next siblings of them should be checked
+void remote_window_children_changed(WindowPtr parent)
 {
-    struct PaintRectRegion* next;
-    int ux1,ux2,uy1,uy2;
+    remote_add_dirty_window(parent, TRUE);
+}
 
-    BOOL haveUnited=FALSE;
-    if(!firstRegion)
-        return FALSE;
-    if(!firstRegion->next)
-        return FALSE;
-    next=firstRegion->next;
-    while(next)
+/*
+ * window is going to be destroyed. Forget the pointer to it and send delete notification to client.
+ * Called by main thread
+ */
+void remote_window_destroyed(WindowPtr win)
+{
+    struct remoteWindow* rwin;
+    int i=0;
+    if(!remoteVars.rootless)
+        return;
+
+    while(i<remoteVars.dirtyWindowsCount)
     {
-        if(!next->united)
+        if(remoteVars.dirtyWindows[i].win == win)
         {
-           //check if we need to unite with this one
-            ux1=(firstRegion->x1 < next->x1)?firstRegion->x1:next->x1;
-            ux2=(firstRegion->x2 > next->x2)?firstRegion->x2:next->x2;
-            uy1=(firstRegion->y1 < next->y1)?firstRegion->y1:next->y1;
-            uy2=(firstRegion->y2 > next->y2)?firstRegion->y2:next->y2;
+            remoteVars.dirtyWindows[i]=remoteVars.dirtyWindows[--remoteVars.dirtyWindowsCount];
+            continue;
+        }
+        ++i;
+    }
+
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    rwin=remote_find_window(win);
+    if(rwin)
+    {
+        remote_unhash_window(rwin);
+        rwin->ptr=NULL;
+        rwin->state=WDEL;
+        remoteVars.windowsUpdated=TRUE;
+    }
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+
+    remote_window_children_changed(win->parent);
+}
+
+/*
+ * find the first window from list in the tree of window.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+struct remoteWindow* remote_find_window_in_tree(WindowPtr win)
+{
+    struct remoteWindow* rwin=remote_find_window(win);
+    WindowPtr child;
+    if(rwin)
+        return rwin;
+    child=win->firstChild;
+    while(child)
+    {
+        rwin=remote_find_window_in_tree(child);
+        if(rwin)
+            return rwin;
+        child=child->nextSib;
+    }
+    return NULL;
+}
+
+/*
+ * check if damaged rectangle belongs to one top level window which is hidden by client.
+ * Such damage is not sent, the window is repainted when client shows it again
+ */
+static
+BOOL remote_damage_hidden(int x, int y, int width, int height)
+{
+    WindowPtr child;
+    BoxRec box;
+    struct remoteWindow* rwin=NULL;
+    BOOL hidden=FALSE;
+
+    if(!remoteVars.rootless || !remoteVars.ephyrScreen)
+        return FALSE;
+
+    box.x1=x;
+    box.y1=y;
+    box.x2=x+width;
+    box.y2=y+height;
+
+    //top level windows are going from top to bottom
+    child=remoteVars.ephyrScreen->pScreen->root->firstChild;
+    while(child)
+    {
+        if(child->viewable)
+        {
+            switch(RegionContainsRect(&child->borderClip, &box))
+            {
+                case rgnIN:
+                    break;
+                case rgnPART:
+                    //damage belongs to more than one window
+                    return FALSE;
+                default:
+                    child=child->nextSib;
+                    continue;
+            }
+            break;
+        }
+        child=child->nextSib;
+    }
+    if(!child)
+        return FALSE;
+
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    rwin=remote_find_window_in_tree(child);
+    if(rwin && rwin->clientHidden)
+    {
+        rwin->damageDeferred=TRUE;
+        hidden=TRUE;
+    }
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    return hidden;
+}
+
+void remote_check_rootless_windows_for_updates(KdScreenInfo *screen)
+{
+    struct remoteWindow* rwin;
+    WindowPtr child;
+    int i;
+
+    if(!remoteVars.rootless || (!remoteVars.windowsFullCheck && !remoteVars.dirtyWindowsCount))
+    {
+        //nothing changed since last check
+        return;
+    }
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+
+    //don't check windows if no client is connected, check the whole tree when it's connected
+    if(remoteVars.client_connected==FALSE)
+    {
+        remoteVars.windowsFullCheck=TRUE;
+        remoteVars.dirtyWindowsCount=0;
+        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        return;
+    }
+
+    if(!remoteVars.windowsFullCheck)
+    {
+        //check only windows which are changed since last check
+        for(i=0;i<remoteVars.dirtyWindowsCount;++i)
+        {
+            if(!remoteVars.dirtyWindows[i].children)
+            {
+                remote_recheck_window(remoteVars.dirtyWindows[i].win);
+                continue;
+            }
+            child=remoteVars.dirtyWindows[i].win->firstChild;
+            while(child)
+            {
+                remote_recheck_window(child);
+                child=child->nextSib;
+            }
+        }
+        remoteVars.dirtyWindowsCount=0;
+        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        return;
+    }
+
+    //         EPHYR_DBG("START TREE CHECK");
+    remote_check_windowstree(screen->pScreen->root);
+
+    //check all windows in list and mark as deleted if not found in the tree
+    rwin=remoteVars.windowList;
+    while(rwin)
+    {
+        if(!rwin->foundInWinTree)
+        {
+            remoteVars.windowsUpdated=TRUE;
+            //mark window as deleted
+            rwin->state=WDEL;
+//             EPHYR_DBG("DELETED WINDOW:  %p, %s",rwin->ptr, rwin->name);
+        }
+        rwin->foundInWinTree=FALSE;
+        rwin=rwin->next;
+    }
+    remoteVars.windowsFullCheck=FALSE;
+    remoteVars.dirtyWindowsCount=0;
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+}
+
+//check if the point belongs to region. If the point is close enough, but not inside of region, extend the region boundaries
+BOOL
+insideOfRegion(struct PaintRectRegion* reg, int x , int y)
+{
+    if(!reg)
+        return FALSE;
+    if(x >= reg->x1 - MAXDISTANCETOREGION && x <= reg->x2+MAXDISTANCETOREGION  &&  y >= reg->y1 - MAXDISTANCETOREGION && y<= reg->y2 + MAXDISTANCETOREGION)
+    {
+        if(x<reg->x1)
+            reg->x1=x;
+        if(x>reg->x2)
+            reg->x2=x;
+        if(y<reg->y1)
+            reg->y1=y;
+        if(y>reg->y2)
+            reg->y2=y;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//find the region, point belongs to
+struct PaintRectRegion*
+findRegionForPoint(struct PaintRectRegion* firstRegion, int x , int y)
+{
+    while(firstRegion)
+    {
+        if(insideOfRegion(firstRegion, x,y))
+            return firstRegion;
+        firstRegion=firstRegion->next;
+    }
+    return firstRegion;
+}
+
+BOOL
+unitePaintRegions(struct PaintRectRegion* firstRegion)
+{
+    struct PaintRectRegion* next;
+    int ux1,ux2,uy1,uy2;
+
+    BOOL haveUnited=FALSE;
+    if(!firstRegion)
+        return FALSE;
+    if(!firstRegion->next)
+        return FALSE;
+    next=firstRegion->next;
+    while(next)
+    {
+        if(!next->united)
+        {
+           //check if we need to unite with this one
+            ux1=(firstRegion->x1 < next->x1)?firstRegion->x1:next->x1;
+            ux2=(firstRegion->x2 > next->x2)?firstRegion->x2:next->x2;
+            uy1=(firstRegion->y1 < next->y1)?firstRegion->y1:next->y1;
+            uy2=(firstRegion->y2 > next->y2)?firstRegion->y2:next->y2;
             //if united size is smaller or same as separated size, we'll unite them
             if(
                 ((firstRegion->x2-firstRegion->x1 +1)*(firstRegion->y2-firstRegion->y1+1) + (next->x2-next->x1 +1)*(next->y2-next->y1+1))>
@@ -4953,9 +6676,10 @@ remote_paint_rect(KdScreenInfo *screen,
     int quarter;
 
 
-    if(remoteVars.rootless)
+    //don't spend time on windows, client is not showing
+    if(size && remote_damage_hidden(dx, dy, width, height))
     {
-        remote_check_rootless_windows_for_updates(screen);
+        return;
     }
     if(size)
     {
@@ -5464,13 +7188,14 @@ int getDirtyScreenRegion(void)
     return worst_reg;
 }
 
-void send_dirty_region(int index)
+uint32_t send_dirty_region(int index)
 {
     //remoteVars.sendqueue_mutex is locked
     int width, height, x, y, winId;
     unsigned char compression;
+    uint32_t length;
     if(index==-1)
-        return;
+        return 0;
     x=(index%remoteVars.reg_horiz)*SCREEN_REG_WIDTH;
     y=(index/remoteVars.reg_horiz)*SCREEN_REG_HEIGHT;
     if(x+SCREEN_REG_WIDTH > remoteVars.main_img_width)
@@ -5488,134 +7213,683 @@ void send_dirty_region(int index)
 //     EPHYR_DBG("SEND REGION UPDATE %d,%d %dx%d", x,y,width,height);
     compression=remoteVars.compression;
     remoteVars.compression=PNG;
-    sendMainImageFromSendThread(width, height, x, y, winId);
+    length=sendMainImageFromSendThread(width, height, x, y, winId);
     remoteVars.compression=compression;
     pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    return length;
 }
 
-//split packet to datagrams and send it
-int send_packet_as_datagrams(unsigned char* data, uint32_t length, uint8_t dgType)
+/* the biggest dgram size which can be sent without fragmentation according to path MTU known by kernel */
+static
+int udp_path_dgram_size(void)
 {
-    /*split to datagrams, reserve header space for each dgram, set sequence number for each dgram ,set correct flag FOR EACH DGRAM and send all datagrams*/
-
-    uint16_t* seqNumber;
-    uint16_t dgSeqNumber=0;
-    uint16_t dgInPack;
-    uint32_t sent_bytes=0;
-    uint16_t dgram_length;
-    unsigned char* dgram;
-    uint32_t checksum;
-    int writeRes;
-
-    dgInPack=length/(UDPDGRAMSIZE-SRVDGRAMHEADERSIZE);
-    if(length%(UDPDGRAMSIZE-SRVDGRAMHEADERSIZE))
-        ++dgInPack;
+    int size=UDPMAXDGRAMSIZE;
+#ifdef IP_MTU
+    int mtu=0;
+    socklen_t len=sizeof(mtu);
 
-//     EPHYR_DBG("Sending DG packet of %d bytes",length);
-    //setting sequence number
-    switch(dgType)
+    if(!getsockopt(remoteVars.sock_udp, IPPROTO_IP, IP_MTU, &mtu, &len) && mtu>0 && mtu-UDPIPHEADERSIZE < size)
     {
-        case ServerFramePacket:
-            seqNumber=&remoteVars.framePacketSeq;
-            break;
-        case ServerRepaintPacket:
-            seqNumber=&remoteVars.repaintPacketSeq;
-            break;
+        size=mtu-UDPIPHEADERSIZE;
     }
-    //         EPHYR_DBG("Seq number: %d", *seqNumber);
-    while(sent_bytes<length)
-    {
-        if((length-sent_bytes)+SRVDGRAMHEADERSIZE <= UDPDGRAMSIZE)
-        {
-            dgram_length=(length-sent_bytes)+SRVDGRAMHEADERSIZE;
-        }
-        else
-        {
-            dgram_length=UDPDGRAMSIZE;
-        }
-
-        dgram=malloc(dgram_length);
-        memset(dgram,0,SRVDGRAMHEADERSIZE);
-        *((uint16_t*)dgram+2)=(*seqNumber);
-        *((uint16_t*)dgram+3)=dgInPack;
-        *((uint16_t*)dgram+4)=dgSeqNumber++;
-        *((uint8_t*)dgram+10)=dgType;
-        memcpy(dgram+SRVDGRAMHEADERSIZE, data+sent_bytes, dgram_length-SRVDGRAMHEADERSIZE);
+#endif /* IP_MTU */
+    return size;
+}
 
-        checksum=crc32(0L, Z_NULL, 0);
-        checksum=crc32(checksum,dgram,dgram_length);
-        //setting checksum
-        *((uint32_t*)dgram)=checksum;
-        writeRes=remote_write_socket(remoteVars.sock_udp, dgram, dgram_length);
-        if(writeRes!=(int)dgram_length)
-        {
-//             EPHYR_DBG("Warning, sending packet failed. Sent %d bytes instead of %d",writeRes,dgram_length);
-        }
-        sent_bytes+=(dgram_length-SRVDGRAMHEADERSIZE);
-        free(dgram);
+/*
+ * set size of datagrams to the biggest size acknowledged by client, but not bigger than path MTU of the UDP socket.
+ * Called when UDP connection is established, when probe is acknowledged and if datagram was too big for the path
+ */
+void update_udp_dgram_size(void)
+{
+    int size=udp_path_dgram_size();
+    if(size>remoteVars.udpConfirmedSize)
+        size=remoteVars.udpConfirmedSize;
+    if(size<UDPMINDGRAMSIZE)
+        size=UDPMINDGRAMSIZE;
+    if(size != remoteVars.udpDgramSize)
+    {
+        EPHYR_DBG("Set UDP datagram size to %d", size);
+        remoteVars.udpDgramSize=size;
     }
-    (*seqNumber)++;
-    return sent_bytes;
 }
 
-unsigned int
-checkClientAlive(OsTimerPtr timer, CARD32 time_card, void* args)
+/* start pacing of new UDP connection from default rate */
+void reset_udp_pacing(void)
 {
-    time_t time_diff;
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
-    time_diff=time(NULL)-remoteVars.last_client_keepalive_time;
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    remoteVars.paceRate=PACE_START_RATE;
+    remoteVars.paceTokens=PACE_BURST;
+    remoteVars.paceLastRefill=remote_time_usec();
+    remoteVars.paceLastUpdate=MyGetTickCount();
+    remoteVars.paceLimited=FALSE;
+    remoteVars.paceLostChecked=remoteVars.udpLostPackets;
+    remoteVars.paceMinRtt=0;
+    remoteVars.paceMinRttTime=0;
+}
 
-    if(time_diff>=CLIENTALIVE_TIMEOUT/1000)
+/*
+ * adjust pacing rate. The client doesn't send timestamps for dgrams, so the delay is measured
+ * as RTT of TCP connection which goes over the same path. If RTT grows above min RTT,
+ * the queue on path is growing and we are sending too fast. Loss of frames reduces rate as well.
+ * Rate is increased only if the sender was limited by pacing.
+ */
+static
+void update_pace_rate(void)
+{
+    long now=MyGetTickCount();
+    uint32_t rtt=0;
+    uint32_t lost;
+    uint64_t rate=remoteVars.paceRate;
+
+    if(now-remoteVars.paceLastUpdate < PACE_UPDATE_INTERVAL)
+        return;
+    remoteVars.paceLastUpdate=now;
+
+#ifdef TCP_INFO
     {
-        EPHYR_DBG("no data from client since %d seconds, diconnecting...", (int)time_diff);
-        disconnect_client();
-        return 0;
+        struct tcp_info info;
+        socklen_t len=sizeof(info);
+        if(!getsockopt(remoteVars.clientsock_tcp, IPPROTO_TCP, TCP_INFO, &info, &len))
+            rtt=info.tcpi_rtt;
+    }
+#endif /* TCP_INFO */
+    if(rtt && (!remoteVars.paceMinRtt || rtt < remoteVars.paceMinRtt || now-remoteVars.paceMinRttTime > PACE_MINRTT_INTERVAL))
+    {
+        remoteVars.paceMinRtt=rtt;
+        remoteVars.paceMinRttTime=now;
     }
-    return CLIENTALIVE_TIMEOUT;
-}
 
-void
-sendServerAlive(void)
-{
-    unsigned char buffer[56] = {0};
-    if(remoteVars.client_os==WEB || remoteVars.client_version<3)
+    lost=remoteVars.udpLostPackets-remoteVars.paceLostChecked;
+    remoteVars.paceLostChecked+=lost;
+
+    if(lost)
     {
-        //client doesn't support this event
-        return;
+        rate=rate*85/100;
     }
-    if((time(NULL) - remoteVars.lastServerKeepAlive)>=SERVERALIVE_TIMEOUT)
+    else if(rtt && rtt > remoteVars.paceMinRtt+((remoteVars.paceMinRtt/4 > 5000)?remoteVars.paceMinRtt/4:5000))
     {
-        *((uint32_t*)buffer)=SRVKEEPALIVE; //4B
-        remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
-//         EPHYR_DBG("SENDING SRV KEEPALIVE!!!!");
+        //queue is building up, rtt is 25% (at least 5ms) more than min rtt
+        rate=rate*90/100;
+    }
+    else if(remoteVars.paceLimited)
+    {
+        rate+=rate/8;
     }
+    if(rate < PACE_MIN_RATE)
+        rate=PACE_MIN_RATE;
+    if(rate > PACE_MAX_RATE)
+        rate=PACE_MAX_RATE;
+    remoteVars.paceRate=rate;
+    remoteVars.paceLimited=FALSE;
+//     EPHYR_DBG("pace rate %u KB/s, rtt %u, min rtt %u, lost %u", remoteVars.paceRate/1024, rtt, remoteVars.paceMinRtt, lost);
 }
 
-void
-send_srv_disconnect(void)
+/*
+ * token bucket, wait till we can send "bytes" with current pacing rate.
+ * Called only by send thread after sendqueue_mutex is unlocked, so main thread is never waiting for pacing
+ */
+static
+void pace_udp_send(uint32_t bytes)
 {
-        unsigned char buffer[56] = {0};
-    _X_UNUSED int l;
+    uint64_t now=remote_time_usec();
 
-    if(remoteVars.client_version<3)
-        return;
-    *((uint32_t*)buffer)=SRVDISCONNECT; //4B
-    l=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
+#ifdef EPHYR_WANT_DEBUG
+    if((unsigned long long)pthread_self() != debug_sendThreadId)
+    {
+        EPHYR_DBG("Warning, UDP dgrams are paced not in send thread");
+    }
+#endif /* EPHYR_WANT_DEBUG */
+    update_pace_rate();
+    remoteVars.paceTokens+=(int64_t)((now-remoteVars.paceLastRefill)*remoteVars.paceRate/1000000);
+    remoteVars.paceLastRefill=now;
+    if(remoteVars.paceTokens > PACE_BURST)
+        remoteVars.paceTokens=PACE_BURST;
+    if(remoteVars.paceTokens < (int64_t)bytes)
+    {
+        //sleep till bucket has enough tokens
+        uint64_t wait=((int64_t)bytes-remoteVars.paceTokens)*1000000/remoteVars.paceRate;
+        struct timespec ts;
+        ts.tv_sec=wait/1000000;
+        ts.tv_nsec=(wait%1000000)*1000;
+        nanosleep(&ts, NULL);
+        remoteVars.paceLimited=TRUE;
+        now=remote_time_usec();
+        remoteVars.paceTokens+=(int64_t)((now-remoteVars.paceLastRefill)*remoteVars.paceRate/1000000);
+        remoteVars.paceLastRefill=now;
+    }
+    remoteVars.paceTokens-=bytes;
 }
 
-void
+/*
+ * send prepared datagrams from slab with as few system calls as possible.
+ * Losing datagrams is not critical here, the client will ask to resend the frame.
+ * Can sleep in pace_udp_send, should be called from send thread without locked mutexes
+ */
+static
+void send_dgram_batch(struct iovec* iov, int count)
+{
+    uint32_t bytes=0;
+#ifdef __linux__
+    struct mmsghdr msgs[UDPBATCHSIZE];
+    int i, sent=0, res;
+
+    memset(msgs, 0, sizeof(struct mmsghdr)*count);
+    for(i=0;i<count;++i)
+    {
+        msgs[i].msg_hdr.msg_iov=&iov[i];
+        msgs[i].msg_hdr.msg_iovlen=1;
+        bytes+=iov[i].iov_len;
+    }
+    pace_udp_send(bytes);
+    while(sent<count)
+    {
+        res=sendmmsg(remoteVars.sock_udp, msgs+sent, count-sent, 0);
+        if(res<0)
+        {
+            if(errno==EINTR)
+                continue;
+            if(errno==EMSGSIZE)
+            {
+                //path MTU is smaller now, next packets will be sent in smaller datagrams
+                update_udp_dgram_size();
+            }
+//             EPHYR_DBG("Warning, sending datagrams failed: %s", strerror(errno));
+            //skip datagram which can't be sent and try the rest
+            res=1;
+        }
+        sent+=res;
+    }
+#else
+    int i;
+    for(i=0;i<count;++i)
+    {
+        bytes+=iov[i].iov_len;
+    }
+    pace_udp_send(bytes);
+    for(i=0;i<count;++i)
+    {
+        remote_write_socket(remoteVars.sock_udp, iov[i].iov_base, iov[i].iov_len);
+    }
+#endif /* __linux__ */
+    remoteVars.lastServerKeepAlive=time(NULL);
+}
+
+/*
+ * build one dgram of packet in dgram buffer, checksum is calculated with zero in checksum field.
+ * Returns length of dgram
+ */
+static
+uint16_t build_dgram(unsigned char* dgram, uint16_t seq, uint16_t dgInPack, uint16_t dgNumber, uint8_t dgType,
+                     unsigned char* data, uint16_t length)
+{
+    *((uint32_t*)dgram)=0;
+    *((uint16_t*)dgram+2)=seq;
+    *((uint16_t*)dgram+3)=dgInPack;
+    *((uint16_t*)dgram+4)=dgNumber;
+    *((uint8_t*)dgram+10)=dgType;
+    memcpy(dgram+SRVDGRAMHEADERSIZE, data, length);
+    //setting checksum
+    *((uint32_t*)dgram)=crc32(0L, dgram, length+SRVDGRAMHEADERSIZE);
+    return length+SRVDGRAMHEADERSIZE;
+}
+
+/*
+ * choose the next size to probe, it's in the middle between acknowledged and failed size.
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+static
+void next_mtu_probe(void)
+{
+    remoteVars.udpProbesSent=0;
+    if(remoteVars.udpProbeMax < remoteVars.udpConfirmedSize+MTUPROBE_MIN_STEP)
+    {
+        EPHYR_DBG("MTU probing finished, client acknowledged datagrams of %d bytes", remoteVars.udpConfirmedSize);
+        remoteVars.udpProbeSize=0;
+        return;
+    }
+    remoteVars.udpProbeSize=(remoteVars.udpConfirmedSize+remoteVars.udpProbeMax+1)/2;
+}
+
+/*
+ * start probing of dgrams bigger than UDPDGRAMSIZE. Datagrams of this size are used only
+ * after client received them, it's possible that big datagrams are silently dropped on the path
+ * warning! sendqueue_mutex should be locked by thread calling this function!
+ */
+void start_mtu_probing(void)
+{
+    remoteVars.udpConfirmedSize=UDPDGRAMSIZE;
+    remoteVars.udpProbeSize=remoteVars.udpProbesSent=0;
+    update_udp_dgram_size();
+    if(remoteVars.client_version < 16)
+        return;
+    remoteVars.udpProbeMax=udp_path_dgram_size();
+    if(remoteVars.udpProbeMax <= remoteVars.udpConfirmedSize)
+        return;
+    //try the biggest size first, on most paths it's working
+    remoteVars.udpProbeSize=remoteVars.udpProbeMax;
+    remoteVars.udpProbeTime=0;
+}
+
+/*
+ * send probe dgram if it's time for it. If client didn't acknowledge the probes of current size, try smaller size.
+ * Called from send thread without locked mutexes, sending of probe can wait for pacing
+ */
+void send_mtu_probe(void)
+{
+    struct iovec iov;
+    unsigned char* dgram=remoteVars.dgramSlab[0];
+    uint16_t size=0, id=0;
+    long now;
+
+    if(!remoteVars.send_frames_over_udp)
+        return;
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    now=MyGetTickCount();
+    if(remoteVars.udpProbeSize && remoteVars.udpProbesSent >= MTUPROBE_RETRIES &&
+       now-remoteVars.udpProbeTime >= MTUPROBE_INTERVAL)
+    {
+        //datagrams of this size are not reaching client
+        EPHYR_DBG("no acknowledge for datagrams of %d bytes", remoteVars.udpProbeSize);
+        remoteVars.udpProbeMax=remoteVars.udpProbeSize-1;
+        next_mtu_probe();
+    }
+    if(remoteVars.udpProbeSize && (!remoteVars.udpProbeTime || now-remoteVars.udpProbeTime >= MTUPROBE_INTERVAL))
+    {
+        size=remoteVars.udpProbeSize;
+        id=++remoteVars.udpProbeId;
+        ++remoteVars.udpProbesSent;
+        remoteVars.udpProbeTime=now;
+    }
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    if(!size)
+        return;
+    iov.iov_base=dgram;
+    iov.iov_len=build_dgram(dgram, id, 1, 0, ServerProbePacket, remoteVars.udpProbePadding, size-SRVDGRAMHEADERSIZE);
+    send_dgram_batch(&iov, 1);
+}
+
+/*
+ * client received probe dgram, dgrams of this size can be used. Called from main thread
+ */
+void process_mtu_probe_ack(uint16_t id, uint16_t size)
+{
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    //acknowledge for older probes of current size is also valid
+    if(remoteVars.udpProbeSize && size == remoteVars.udpProbeSize &&
+       (uint16_t)(remoteVars.udpProbeId-id) < MTUPROBE_RETRIES)
+    {
+        EPHYR_DBG("client acknowledged datagram of %d bytes", size);
+        remoteVars.udpConfirmedSize=size;
+        next_mtu_probe();
+        //send thread will use new size with the next packet
+        remoteVars.udpResizePending=TRUE;
+        pthread_cond_signal(&remoteVars.have_sendqueue_cond);
+    }
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+}
+
+/*
+ * keep copy of sent frame packet, oldest packets are removed if the store is full.
+ * Called only by send thread
+ */
+static
+void store_sent_packet(unsigned char* data, uint32_t length, uint16_t seq, uint16_t payloadSize, uint16_t dgInPack)
+{
+    struct sent_packet* packet;
+
+    if(length > RETRANS_STORE_MAXBYTES)
+        return;
+    //free space for new packet
+    while(remoteVars.retransBytes+length > RETRANS_STORE_MAXBYTES || remoteVars.retransStore[remoteVars.retransNext].data)
+    {
+        packet=&remoteVars.retransStore[remoteVars.retransNext];
+        if(packet->data)
+        {
+            remoteVars.retransBytes-=packet->length;
+            free(packet->data);
+            packet->data=NULL;
+        }
+        else
+        {
+            //not enough space yet, remove older packets
+            int i;
+            for(i=1;i<RETRANS_STORE_SIZE;++i)
+            {
+                packet=&remoteVars.retransStore[(remoteVars.retransNext+i)%RETRANS_STORE_SIZE];
+                if(packet->data)
+                {
+                    remoteVars.retransBytes-=packet->length;
+                    free(packet->data);
+                    packet->data=NULL;
+                    break;
+                }
+            }
+        }
+    }
+    packet=&remoteVars.retransStore[remoteVars.retransNext];
+    packet->data=malloc(length);
+    memcpy(packet->data, data, length);
+    packet->length=length;
+    //FRAME has crc in 7th field, CACHEFRAME in 2nd
+    packet->crc=(*((uint32_t*)data) == CACHEFRAME)?*((uint32_t*)data+1):*((uint32_t*)data+6);
+    packet->seq=seq;
+    packet->payloadSize=payloadSize;
+    packet->dgInPack=dgInPack;
+    remoteVars.retransBytes+=length;
+    remoteVars.retransNext=(remoteVars.retransNext+1)%RETRANS_STORE_SIZE;
+}
+
+static
+struct sent_packet* find_sent_packet(uint16_t seq)
+{
+    int i;
+    for(i=0;i<RETRANS_STORE_SIZE;++i)
+    {
+        if(remoteVars.retransStore[i].data && remoteVars.retransStore[i].seq == seq)
+            return &remoteVars.retransStore[i];
+    }
+    return NULL;
+}
+
+/* find CACHEFRAME packet which was sent to client, new FRAME packets can't be sent twice */
+static
+struct sent_packet* find_sent_cache_frame(uint32_t crc)
+{
+    int i;
+    for(i=0;i<RETRANS_STORE_SIZE;++i)
+    {
+        struct sent_packet* packet=&remoteVars.retransStore[i];
+        if(packet->data && packet->crc == crc && *((uint32_t*)packet->data) == CACHEFRAME)
+            return packet;
+    }
+    return NULL;
+}
+
+/*
+ * resend dgrams of stored frame packet which were lost. Dgrams are the same as the first time,
+ * so the client can put them in the packet which is waiting for them.
+ * Returns amount of sent bytes
+ */
+static
+uint32_t resend_dgrams(uint16_t seq, uint16_t* dgrams, uint16_t count)
+{
+    struct sent_packet* packet=find_sent_packet(seq);
+    struct iovec iov[UDPBATCHSIZE];
+    uint32_t offset, sent=0;
+    uint16_t i, length;
+    int batch=0;
+
+    if(!packet)
+    {
+//         EPHYR_DBG("packet %d is not in retransmission store anymore", seq);
+        return 0;
+    }
+    for(i=0;i<count;++i)
+    {
+        if(dgrams[i] >= packet->dgInPack)
+            continue;
+        offset=dgrams[i]*packet->payloadSize;
+        length=(packet->length-offset < packet->payloadSize)?(packet->length-offset):packet->payloadSize;
+        iov[batch].iov_base=remoteVars.dgramSlab[batch];
+        iov[batch].iov_len=build_dgram(remoteVars.dgramSlab[batch], seq, packet->dgInPack, dgrams[i], ServerFramePacket,
+                                       packet->data+offset, length);
+        sent+=length;
+        ++batch;
+    }
+    if(batch)
+        send_dgram_batch(iov, batch);
+    return sent;
+}
+
+/*
+ * choose amount of dgrams protected by one parity dgram from the amount of frames client asked to resend.
+ * Called by send thread after every frame packet
+ */
+static
+void update_fec_group_size(void)
+{
+    uint32_t lost, rate;
+
+    if(remoteVars.fecMode != FEC_ADAPTIVE || ++remoteVars.fecPackets < FEC_CHECK_PACKETS)
+        return;
+
+    //counter is increased by main thread, don't reset it to not lose new requests
+    lost=remoteVars.udpLostPackets-remoteVars.fecLostChecked;
+    remoteVars.fecLostChecked+=lost;
+    //lost packets per 1000
+    rate=lost*1000/remoteVars.fecPackets;
+    remoteVars.fecPackets=0;
+
+    if(!rate)
+        remoteVars.fecGroupSize=0;
+    else if(rate <= 20)
+        remoteVars.fecGroupSize=16;
+    else if(rate <= 50)
+        remoteVars.fecGroupSize=8;
+    else
+        remoteVars.fecGroupSize=4;
+//     EPHYR_DBG("packet loss %d/1000, parity dgram for every %d dgrams", rate, remoteVars.fecGroupSize);
+}
+
+/*
+ * split packet to datagrams and send it. If packet is sent from retransmission store,
+ * the stored packet gets the new sequence number instead of storing it again
+ */
+static
+int send_datagrams(unsigned char* data, uint32_t length, uint8_t dgType, struct sent_packet* stored)
+{
+    /*split to datagrams, reserve header space for each dgram, set sequence number for each dgram ,set correct flag FOR EACH DGRAM and send all datagrams*/
+
+    uint16_t* seqNumber;
+    uint16_t dgSeqNumber=0;
+    uint16_t dgInPack;
+    uint32_t sent_bytes=0;
+    uint16_t dgram_length;
+    unsigned char* dgram;
+    struct iovec iov[UDPBATCHSIZE];
+    int batch=0;
+    uint16_t payload_size=remoteVars.udpDgramSize-SRVDGRAMHEADERSIZE;
+    uint16_t fecGroup=0;
+    uint16_t groupStart=0, groupLength=0, groupMaxData=0, lengthXor=0;
+    int i;
+
+    //send parity dgrams only for frames, loss of repaint can be ignored
+    if(dgType == ServerFramePacket && remoteVars.client_version >= 10)
+    {
+        fecGroup=remoteVars.fecGroupSize;
+        if(fecGroup)
+        {
+            //parity dgram has additional header, it should fit in dgram as well
+            payload_size-=FECHEADERSIZE;
+        }
+    }
+
+    dgInPack=length/payload_size;
+    if(length%payload_size)
+        ++dgInPack;
+
+//     EPHYR_DBG("Sending DG packet of %d bytes",length);
+    //setting sequence number
+    switch(dgType)
+    {
+        case ServerFramePacket:
+            seqNumber=&remoteVars.framePacketSeq;
+            break;
+        case ServerRepaintPacket:
+            seqNumber=&remoteVars.repaintPacketSeq;
+            break;
+    }
+    //         EPHYR_DBG("Seq number: %d", *seqNumber);
+    if(stored)
+    {
+        //data of stored packet stays the same, only the way it's split to dgrams could change
+        stored->seq=*seqNumber;
+        stored->payloadSize=payload_size;
+        stored->dgInPack=dgInPack;
+    }
+    else if(dgType == ServerFramePacket)
+    {
+        //client can ask to resend lost dgrams of this packet
+        store_sent_packet(data, length, *seqNumber, payload_size, dgInPack);
+    }
+    while(sent_bytes<length)
+    {
+        if(length-sent_bytes <= payload_size)
+        {
+            dgram_length=(length-sent_bytes)+SRVDGRAMHEADERSIZE;
+        }
+        else
+        {
+            dgram_length=payload_size+SRVDGRAMHEADERSIZE;
+        }
+
+        //build datagram in slab
+        dgram=remoteVars.dgramSlab[batch];
+        build_dgram(dgram, *seqNumber, dgInPack, dgSeqNumber++, dgType, data+sent_bytes, dgram_length-SRVDGRAMHEADERSIZE);
+        iov[batch].iov_base=dgram;
+        iov[batch].iov_len=dgram_length;
+        sent_bytes+=(dgram_length-SRVDGRAMHEADERSIZE);
+
+        if(fecGroup)
+        {
+            //add data of dgram to parity of the group
+            if(!groupLength)
+            {
+                memset(remoteVars.fecParity, 0, payload_size);
+                groupStart=dgSeqNumber-1;
+                groupMaxData=lengthXor=0;
+            }
+            for(i=0;i<dgram_length-SRVDGRAMHEADERSIZE;++i)
+            {
+                remoteVars.fecParity[i]^=dgram[SRVDGRAMHEADERSIZE+i];
+            }
+            lengthXor^=dgram_length-SRVDGRAMHEADERSIZE;
+            if(groupMaxData < dgram_length-SRVDGRAMHEADERSIZE)
+                groupMaxData=dgram_length-SRVDGRAMHEADERSIZE;
+            ++groupLength;
+        }
+
+        //slab is full or it's the last datagram of packet
+        if(++batch == UDPBATCHSIZE || sent_bytes >= length)
+        {
+            send_dgram_batch(iov, batch);
+            batch=0;
+        }
+
+        if(fecGroup && (groupLength == fecGroup || sent_bytes >= length))
+        {
+            //group is complete, send parity dgram. Dgram seq number is the number of first dgram in group
+            dgram=remoteVars.dgramSlab[batch];
+            dgram_length=SRVDGRAMHEADERSIZE+FECHEADERSIZE+groupMaxData;
+            *((uint32_t*)dgram)=0;
+            *((uint16_t*)dgram+2)=(*seqNumber);
+            *((uint16_t*)dgram+3)=dgInPack;
+            *((uint16_t*)dgram+4)=groupStart;
+            *((uint8_t*)dgram+10)=ServerParityPacket;
+            *((uint16_t*)(dgram+SRVDGRAMHEADERSIZE))=groupLength;
+            *((uint16_t*)(dgram+SRVDGRAMHEADERSIZE+2))=lengthXor;
+            memcpy(dgram+SRVDGRAMHEADERSIZE+FECHEADERSIZE, remoteVars.fecParity, groupMaxData);
+            *((uint32_t*)dgram)=crc32(0L, dgram, dgram_length);
+            iov[batch].iov_base=dgram;
+            iov[batch].iov_len=dgram_length;
+            if(++batch == UDPBATCHSIZE || sent_bytes >= length)
+            {
+                send_dgram_batch(iov, batch);
+                batch=0;
+            }
+            groupLength=0;
+        }
+    }
+    (*seqNumber)++;
+    if(dgType == ServerFramePacket)
+    {
+        update_fec_group_size();
+    }
+    return sent_bytes;
+}
+
+int send_packet_as_datagrams(unsigned char* data, uint32_t length, uint8_t dgType)
+{
+    return send_datagrams(data, length, dgType, NULL);
+}
+
+unsigned int
+checkClientAlive(OsTimerPtr timer, CARD32 time_card, void* args)
+{
+    time_t time_diff;
+    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    time_diff=time(NULL)-remoteVars.last_client_keepalive_time;
+    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+
+    if(time_diff>=CLIENTALIVE_TIMEOUT/1000)
+    {
+        EPHYR_DBG("no data from client since %d seconds, diconnecting...", (int)time_diff);
+        disconnect_client();
+        return 0;
+    }
+    return CLIENTALIVE_TIMEOUT;
+}
+
+void
+sendServerAlive(void)
+{
+    unsigned char buffer[56] = {0};
+    if(remoteVars.client_os==WEB || remoteVars.client_version<3)
+    {
+        //client doesn't support this event
+        return;
+    }
+    if((time(NULL) - remoteVars.lastServerKeepAlive)>=SERVERALIVE_TIMEOUT)
+    {
+        *((uint32_t*)buffer)=SRVKEEPALIVE; //4B
+        remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
+//         EPHYR_DBG("SENDING SRV KEEPALIVE!!!!");
+    }
+}
+
+void
+send_srv_disconnect(void)
+{
+        unsigned char buffer[56] = {0};
+    _X_UNUSED int l;
+
+    if(remoteVars.client_version<3)
+        return;
+    *((uint32_t*)buffer)=SRVDISCONNECT; //4B
+    l=remote_write_socket(remoteVars.clientsock_tcp,buffer,56);
+}
+
+void
 clean_everything(void)
 {
     //sendqueue_mutex is locked
+    pthread_mutex_lock(&remoteVars.cache_mutex);
     clear_send_queue();
     clear_frame_cache(0);
+    clear_resend_requests();
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+
+    pthread_mutex_lock(&remoteVars.cursor_mutex);
     freeCursors();
+    pthread_mutex_unlock(&remoteVars.cursor_mutex);
+
+    pthread_mutex_lock(&remoteVars.selection_mutex);
     clear_output_selection();
+    pthread_mutex_unlock(&remoteVars.selection_mutex);
+
     delete_all_windows();
     remoteVars.framePacketSeq=remoteVars.repaintPacketSeq=0;
+    remoteVars.fecPackets=remoteVars.udpLostPackets=remoteVars.fecLostChecked=0;
+    reset_udp_pacing();
+    if(remoteVars.fecMode == FEC_ADAPTIVE)
+        remoteVars.fecGroupSize=0;
 }
 
+/*
+ * client asks to resend frame from cache. Called from send thread without locked mutexes.
+ * If the frame was already resent recently, the stored packet is sent again, otherwise
+ * the frame is compressed and stored in retransmission store
+ */
 void
 resend_frame(uint32_t crc)
 {
@@ -5623,30 +7897,136 @@ resend_frame(uint32_t crc)
     unsigned char* data;
     unsigned char* packet;
     uint32_t size;
-    struct cache_elem* frame=find_cache_element(crc);
+    struct cache_elem* frame = NULL;
+    struct sent_packet* sent;
     EPHYR_DBG("Client asks to resend frame from cash with crc %x",crc);
-    if(remoteVars.send_frames_over_udp)
+    if(!remoteVars.send_frames_over_udp)
         return;
-    pthread_mutex_lock(&remoteVars.sendqueue_mutex);
+    sent=find_sent_cache_frame(crc);
+    if(sent)
+    {
+        send_datagrams(sent->data, sent->length, ServerFramePacket, sent);
+        return;
+    }
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    frame=find_cache_element(crc);
     if(! frame)
     {
         EPHYR_DBG("requested frame not found in cache");
-        pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+        pthread_mutex_unlock(&remoteVars.cache_mutex);
         return;
     }
+    //frame is busy till it's compressed, so it's not removed from cache meanwhile
+    frame->busy+=1;
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
     data=image_compress(frame->width, frame->height, frame->data, &(size), CACHEBPP, 0l);
-    pthread_mutex_unlock(&remoteVars.sendqueue_mutex);
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    frame->busy--;
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
     packet=malloc(size+8);
     *((uint32_t*)packet)=CACHEFRAME;
     *((uint32_t*)packet+1)=crc;
     memcpy(packet+8, data, size);
     free(data);
     send_packet_as_datagrams(packet,size+8,ServerFramePacket);
+    free(packet);
+}
+
+/*
+ * client's requests are processed by send thread, so only send thread is writing to UDP socket.
+ * If count is 0, client asks to resend frame with crc from cache, otherwise it asks to resend dgrams of packet seq
+ */
+void
+add_resend_request(uint32_t crc, uint16_t seq, uint16_t count, uint16_t* dgrams)
+{
+    struct resend_request* request;
+
+    if(!remoteVars.send_frames_over_udp)
+        return;
+    request=malloc(sizeof(struct resend_request));
+    request->next=NULL;
+    request->crc=crc;
+    request->seq=seq;
+    request->count=(count>RESENDDGRAMS_MAX)?RESENDDGRAMS_MAX:count;
+    if(request->count)
+        memcpy(request->dgrams, dgrams, request->count*sizeof(uint16_t));
+
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    if(remoteVars.last_resend_request)
+        remoteVars.last_resend_request->next=request;
+    else
+        remoteVars.first_resend_request=request;
+    remoteVars.last_resend_request=request;
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+    remote_wakeup_send_thread();
+}
+
+/*
+ * take all resend requests from queue and process them. Should be called from send thread without locked mutexes.
+ * Returns amount of sent bytes
+ */
+uint32_t process_resend_requests(void)
+{
+    struct resend_request* request;
+    struct resend_request* next;
+    uint32_t sent=0;
+
+    pthread_mutex_lock(&remoteVars.cache_mutex);
+    request=remoteVars.first_resend_request;
+    remoteVars.first_resend_request=remoteVars.last_resend_request=NULL;
+    pthread_mutex_unlock(&remoteVars.cache_mutex);
+
+    while(request)
+    {
+        next=request->next;
+        if(request->count)
+            sent+=resend_dgrams(request->seq, request->dgrams, request->count);
+        else
+            resend_frame(request->crc);
+        free(request);
+        request=next;
+    }
+    return sent;
+}
+
+/*
+ * free resend requests of disconnected client.
+ * warning! cache_mutex should be locked by thread calling this function!
+ */
+void clear_resend_requests(void)
+{
+    struct resend_request* request;
+
+    while(remoteVars.first_resend_request)
+    {
+        request=remoteVars.first_resend_request;
+        remoteVars.first_resend_request=request->next;
+        free(request);
+    }
+    remoteVars.last_resend_request=NULL;
+}
+
+/*
+ * free stored packets of disconnected client.
+ * Retransmission store is used only by send thread, so it's called by send thread when client is disconnected
+ */
+void clear_retransmission_store(void)
+{
+    int i;
+
+    for(i=0;i<RETRANS_STORE_SIZE;++i)
+    {
+        free(remoteVars.retransStore[i].data);
+        remoteVars.retransStore[i].data=NULL;
+    }
+    remoteVars.retransNext=0;
+    remoteVars.retransBytes=0;
 }
 
 void
 close_client_sockets(void)
 {
+    stop_output_flushing(TRUE);
     shutdown(remoteVars.clientsock_tcp, SHUT_RDWR);
     close(remoteVars.clientsock_tcp);
     close_udp_socket();
@@ -5664,9 +8044,725 @@ void close_udp_socket(void)
     }
 }
 
+/*
+ * append data to output buffer, buffer grows if the data doesn't fit.
+ * Returns FALSE if buffer can't grow.
+ * warning! outbuf_mutex should be locked by thread calling this function!
+ */
+static
+BOOL outbuf_append(struct OutputBuffer* ob, const void *buf, size_t count)
+{
+    size_t end, first;
+
+    if(ob->length+count > ob->size)
+    {
+        //allocate new buffer and move the data to the beginning of it
+        size_t newsize=ob->size?ob->size:OUTBUFSIZE;
+        unsigned char* newdata;
+
+        while(newsize < ob->length+count)
+            newsize*=2;
+        newdata=malloc(newsize);
+        if(!newdata)
+        {
+            EPHYR_DBG("error allocating output buffer of size %lu", (unsigned long)newsize);
+            return FALSE;
+        }
+        first=(ob->size - ob->start < ob->length)?(ob->size - ob->start):ob->length;
+        if(ob->length)
+        {
+            memcpy(newdata, ob->data+ob->start, first);
+            memcpy(newdata+first, ob->data, ob->length-first);
+        }
+        free(ob->data);
+        ob->data=newdata;
+        ob->size=newsize;
+        ob->start=0;
+    }
+
+    //copy data after the last byte, wrapping to the beginning of buffer
+    end=(ob->start+ob->length)%ob->size;
+    first=(ob->size-end < count)?(ob->size-end):count;
+    memcpy(ob->data+end, buf, first);
+    memcpy(ob->data, (const unsigned char*)buf+first, count-first);
+    ob->length+=count;
+    return TRUE;
+}
+
+/*
+ * client is not reading data or output buffer can't grow anymore. Drop the data and close the connection,
+ * main thread will get EOF on client socket and disconnect client.
+ * warning! outbuf_mutex should be locked by thread calling this function!
+ */
+static
+void outbuf_overflow(void)
+{
+    EPHYR_DBG("output buffer overflow, %lu bytes are waiting, closing connection", (unsigned long)remoteVars.outbuf.length);
+    remoteVars.outbuf.closed=TRUE;
+    remoteVars.outbuf.start=remoteVars.outbuf.length=0;
+    pthread_cond_signal(&remoteVars.outbuf_cond);
+    shutdown(remoteVars.clientsock_tcp, SHUT_RDWR);
+}
+
+/*
+ * write as much data from output buffer as the socket can take without blocking.
+ * warning! outbuf_mutex should be locked by thread calling this function!
+ */
+static
+ssize_t outbuf_write(struct OutputBuffer* ob, int fd)
+{
+    struct iovec iov[2];
+    int iovcnt=1;
+    ssize_t l;
+
+    iov[0].iov_base=ob->data+ob->start;
+    iov[0].iov_len=ob->length;
+    if(ob->start+ob->length > ob->size)
+    {
+        //data is wrapped to the beginning of buffer
+        iov[0].iov_len=ob->size-ob->start;
+        iov[1].iov_base=ob->data;
+        iov[1].iov_len=ob->length-iov[0].iov_len;
+        iovcnt=2;
+    }
+    l=writev(fd, iov, iovcnt);
+    if(l>0)
+    {
+        ob->start=(ob->start+l)%ob->size;
+        ob->length-=l;
+        if(!ob->length)
+            ob->start=0;
+    }
+    return l;
+}
+
+/*
+ * this thread is writing data from output buffer to client socket.
+ * Socket is non-blocking, so the thread never holds outbuf_mutex while waiting for the client
+ */
+static
+void *flush_thread(void *threadid)
+{
+    struct pollfd fds;
+    ssize_t l;
+
+    fds.fd=remoteVars.clientsock_tcp;
+    fds.events=POLLOUT;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    while(!remoteVars.outbuf.closed || remoteVars.outbuf.length)
+    {
+        if(!remoteVars.outbuf.length)
+        {
+            pthread_cond_wait(&remoteVars.outbuf_cond, &remoteVars.outbuf_mutex);
+            continue;
+        }
+        l=outbuf_write(&remoteVars.outbuf, fds.fd);
+        if(l>=0 || errno==EINTR)
+            continue;
+        if((errno==EAGAIN || errno==EWOULDBLOCK) && !remoteVars.outbuf.closed)
+        {
+            //socket buffer is full, wait till client reads some data
+            pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+            poll(&fds, 1, 100);
+            pthread_mutex_lock(&remoteVars.outbuf_mutex);
+            continue;
+        }
+        //error or connection is closing and client doesn't read data, drop the rest
+        EPHYR_DBG("dropping %lu bytes from output buffer", (unsigned long)remoteVars.outbuf.length);
+        remoteVars.outbuf.closed=TRUE;
+        break;
+    }
+    remoteVars.outbuf.start=remoteVars.outbuf.length=0;
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    EPHYR_DBG("exit flush thread");
+    pthread_exit(0);
+}
+
+/* make client socket non-blocking and start the thread writing the output buffer to it */
+void start_output_flushing(void)
+{
+    int ret;
+    int flags=fcntl(remoteVars.clientsock_tcp, F_GETFL, 0);
+
+    //flush thread of previous connection should be already finished
+    if(remoteVars.flush_thread_id)
+    {
+        stop_output_flushing(TRUE);
+    }
+
+    if(fcntl(remoteVars.clientsock_tcp, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        EPHYR_DBG("failed to set client socket non-blocking");
+    }
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    remoteVars.outbuf.start=remoteVars.outbuf.length=0;
+    remoteVars.outbuf.closed=FALSE;
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+
+    ret = pthread_create(&remoteVars.flush_thread_id, NULL, flush_thread, NULL);
+    if (ret)
+    {
+        EPHYR_DBG("ERROR; return code from pthread_create() is %d\n", ret);
+        terminateServer(-1);
+    }
+}
+
+/*
+ * tell flush thread to exit after writing the data which socket can take without blocking.
+ * If wait is TRUE, wait till the thread is finished
+ */
+void stop_output_flushing(BOOL wait)
+{
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    remoteVars.outbuf.closed=TRUE;
+    pthread_cond_signal(&remoteVars.outbuf_cond);
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    if(wait && remoteVars.flush_thread_id)
+    {
+        pthread_join(remoteVars.flush_thread_id, NULL);
+        remoteVars.flush_thread_id=0;
+    }
+}
+
+/* amount of bytes which are waiting to be written to client */
+size_t remote_output_backlog(void)
+{
+    size_t length;
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    length=remoteVars.outbuf.length;
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    return length;
+}
+
+/* client is not reading data fast enough, new frames should wait */
+BOOL remote_output_congested(void)
+{
+    return (remote_output_backlog() > OUTBUF_CONGESTION_LIMIT);
+}
+
+/*
+ * copy message which is sent to client to output buffers of active viewers.
+ * Viewer which can't take the message is not getting new data till the next resync,
+ * so it never gets a part of message.
+ * warning! outbuf_mutex should be locked by thread calling this function!
+ */
+static
+void viewers_append(struct iovec *iov, int iovcnt)
+{
+    struct remoteViewer* viewer;
+    size_t total=0;
+    int i,v;
+
+    if(!remoteVars.maxViewers || iovcnt < 1)
+        return;
+
+    //viewers are view only, they are not getting clipboard of client
+    if(iov[0].iov_len >= sizeof(uint32_t) && *((uint32_t*)iov[0].iov_base) == SELECTION)
+        return;
+
+    for(i=0;i<iovcnt;++i)
+        total+=iov[i].iov_len;
+
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        viewer=&remoteVars.viewers[v];
+        if(viewer->state != VIEWER_ACTIVE)
+            continue;
+        if(viewer->outbuf.length+total > VIEWER_BACKLOG_LIMIT)
+        {
+            //main thread will close the connection, client is not affected by slow viewer
+            EPHYR_DBG("viewer %d is not reading fast enough, disconnecting", v);
+            viewer->state=VIEWER_CLOSING;
+            viewer->outbuf.start=viewer->outbuf.length=0;
+            continue;
+        }
+        for(i=0;i<iovcnt;++i)
+        {
+            if(!outbuf_append(&viewer->outbuf, iov[i].iov_base, iov[i].iov_len))
+            {
+                viewer->state=VIEWER_CLOSING;
+                viewer->outbuf.start=viewer->outbuf.length=0;
+                break;
+            }
+        }
+    }
+    pthread_cond_signal(&remoteVars.viewers_cond);
+}
+
+/*
+ * pending viewers start getting data from this point, the next message is reinit notification.
+ * Called from send thread before sending reinit notification, returns TRUE if some viewer joined
+ */
+BOOL activate_pending_viewers(void)
+{
+    unsigned char buffer[56] = {0};
+    struct remoteViewer* viewer;
+    BOOL joined=FALSE;
+    int v;
+
+    *((uint32_t*)buffer)=SERVERVERSION;
+    *((uint16_t*)buffer+2)=FEATURE_VERSION;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        viewer=&remoteVars.viewers[v];
+        if(viewer->state != VIEWER_PENDING)
+            continue;
+        //if client doesn't know server version yet, viewer gets it together with client
+        if(!viewer->versionSent && remoteVars.server_version_sent)
+        {
+            if(!outbuf_append(&viewer->outbuf, buffer, 56))
+                continue;
+            viewer->versionSent=TRUE;
+        }
+        EPHYR_DBG("viewer %d joined", v);
+        viewer->state=VIEWER_ACTIVE;
+        joined=TRUE;
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    return joined;
+}
+
+/*
+ * this thread is writing output buffers of viewers to their non-blocking sockets
+ */
+static
+void *viewers_flush_thread(void *threadid)
+{
+    struct pollfd fds[MAXVIEWERS];
+    int nfds, v;
+    ssize_t l;
+    BOOL haveData;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    while(1)
+    {
+        nfds=0;
+        haveData=FALSE;
+        for(v=0;v<remoteVars.maxViewers;++v)
+        {
+            struct remoteViewer* viewer=&remoteVars.viewers[v];
+            if((viewer->state != VIEWER_PENDING && viewer->state != VIEWER_ACTIVE) || !viewer->outbuf.length)
+                continue;
+            haveData=TRUE;
+            l=outbuf_write(&viewer->outbuf, viewer->sock);
+            if(l>=0 || errno==EINTR)
+                continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+            {
+                fds[nfds].fd=viewer->sock;
+                fds[nfds].events=POLLOUT;
+                ++nfds;
+                continue;
+            }
+            //main thread will close the connection
+            EPHYR_DBG("error writing to viewer %d", v);
+            viewer->state=VIEWER_CLOSING;
+            viewer->outbuf.start=viewer->outbuf.length=0;
+        }
+        if(nfds)
+        {
+            //wait till one of viewers reads some data
+            pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+            poll(fds, nfds, 100);
+            pthread_mutex_lock(&remoteVars.outbuf_mutex);
+        }
+        else if(!haveData)
+        {
+            pthread_cond_wait(&remoteVars.viewers_cond, &remoteVars.outbuf_mutex);
+        }
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    pthread_exit(0);
+}
+
+static
+struct remoteViewer* find_viewer(int fd)
+{
+    int v;
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        if(remoteVars.viewers[v].state != VIEWER_FREE && remoteVars.viewers[v].sock == fd)
+            return &remoteVars.viewers[v];
+    }
+    return NULL;
+}
+
+/*
+ * viewer should send cookie first and then CLIENTVERSION event as fixed length event, it waits for resync to join.
+ * Viewer is getting the same stream as client, so it should have the same version as client.
+ * Viewers are view only, other data from them is read and dropped
+ */
+static void
+viewerReadNotify(int fd, int ready, void *data)
+{
+    char buffer[EVLENGTH*16];
+    struct remoteViewer* viewer;
+    ssize_t length;
+    BOOL closing=FALSE;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    viewer=find_viewer(fd);
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    if(!viewer)
+        return;
+
+    if(viewer->state == VIEWER_AUTH)
+    {
+        length=read(fd, viewer->cookie+viewer->cookieBytes, 32-viewer->cookieBytes);
+        if(length > 0)
+        {
+            viewer->cookieBytes+=length;
+            if(viewer->cookieBytes < 32)
+                return;
+            pthread_mutex_lock(&remoteVars.outbuf_mutex);
+            if(strncmp(viewer->cookie, remoteVars.cookie, 32))
+            {
+                EPHYR_DBG("Wrong cookie from viewer");
+                viewer->state=VIEWER_CLOSING;
+                closing=TRUE;
+            }
+            else
+            {
+                EPHYR_DBG("viewer cookie approved, waiting for version");
+                viewer->state=VIEWER_VERSION;
+            }
+            pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+            if(closing)
+                remote_check_viewers();
+            return;
+        }
+    }
+    else if(viewer->state == VIEWER_VERSION)
+    {
+        length=read(fd, viewer->versionEvent+viewer->versionBytes, EVLENGTH-viewer->versionBytes);
+        if(length > 0)
+        {
+            uint16_t ver, os;
+
+            viewer->versionBytes+=length;
+            if(viewer->versionBytes < EVLENGTH)
+                return;
+            ver=*((uint16_t*)viewer->versionEvent+2);
+            os=*((uint16_t*)viewer->versionEvent+3);
+            pthread_mutex_lock(&remoteVars.outbuf_mutex);
+            //input id in frames, format of cursors and other features are depending on version of client
+            if(*((uint32_t*)viewer->versionEvent) != CLIENTVERSION || ver != remoteVars.client_version ||
+               (os == WEB) != (remoteVars.client_os == WEB))
+            {
+                EPHYR_DBG("viewer version %d, os %d doesn't match client version %d, os %d", ver, os,
+                          remoteVars.client_version, remoteVars.client_os);
+                viewer->state=VIEWER_CLOSING;
+            }
+            else
+            {
+                EPHYR_DBG("viewer version approved, waiting for resync");
+                viewer->state=VIEWER_PENDING;
+                remoteVars.viewerResyncRequested=TRUE;
+            }
+            pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+            remote_check_viewers();
+            return;
+        }
+    }
+    else
+    {
+        length=read(fd, buffer, sizeof(buffer));
+    }
+    if(length > 0 || (length < 0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)))
+        return;
+
+    EPHYR_DBG("viewer disconnected");
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    if(viewer->state != VIEWER_FREE)
+    {
+        viewer->state=VIEWER_CLOSING;
+        closing=TRUE;
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    if(closing)
+        remote_check_viewers();
+}
+
+/*
+ * close viewers which didn't send cookie and version in time and start delayed resync for new viewers.
+ * Timer is active while some viewer is sending cookie, version or waiting for resync
+ */
+static
+unsigned int checkViewers(OsTimerPtr timer, CARD32 time_card, void* args)
+{
+    BOOL waiting;
+    int v;
+
+    remote_check_viewers();
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    waiting=remoteVars.viewerResyncRequested;
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        if(remoteVars.viewers[v].state == VIEWER_AUTH || remoteVars.viewers[v].state == VIEWER_VERSION)
+            waiting=TRUE;
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    return waiting?1000:0;
+}
+
+static
+BOOL viewers_enabled(void)
+{
+    //viewers are getting copy of TCP stream, it's possible only if frames are not sent over UDP
+    //in rootless mode frames are belonging to windows of client, don't share them
+#if XORG_VERSION_CURRENT >= 11900000
+    return remoteVars.maxViewers && !remoteVars.rootless && !remoteVars.send_frames_over_udp &&
+           (remoteVars.compression == JPEG || remoteVars.compression == PNG);
+#else
+    return FALSE;
+#endif /* XORG_VERSION_CURRENT */
+}
+
+void accept_viewer(void)
+{
+    struct sockaddr_in address;
+    socklen_t addrlen=sizeof(address);
+    struct remoteViewer* viewer=NULL;
+    int sock, flags, v;
+
+    sock=accept(remoteVars.serversock_tcp, (struct sockaddr *) &address, &addrlen);
+    if(sock <= 0)
+    {
+        EPHYR_DBG("ACCEPT ERROR OR CANCELD!\n");
+        return;
+    }
+    EPHYR_DBG("Viewer connection from (%s)...\n", inet_ntoa (address.sin_addr));
+    if(!viewers_enabled())
+    {
+        close(sock);
+        return;
+    }
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        if(remoteVars.viewers[v].state == VIEWER_FREE)
+        {
+            viewer=&remoteVars.viewers[v];
+            break;
+        }
+    }
+    if(!viewer)
+    {
+        pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+        EPHYR_DBG("too many viewers, closing connection");
+        close(sock);
+        return;
+    }
+    flags=fcntl(sock, F_GETFL, 0);
+    if(fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        EPHYR_DBG("failed to set viewer socket non-blocking");
+    }
+    viewer->sock=sock;
+    viewer->outbuf.start=viewer->outbuf.length=0;
+    viewer->outbuf.closed=FALSE;
+    viewer->versionSent=FALSE;
+    viewer->cookieBytes=viewer->versionBytes=0;
+    viewer->acceptTime=GetTimeInMillis();
+    if(strlen(remoteVars.cookie))
+    {
+        //cookie is read in viewerReadNotify, main thread is not waiting for it
+        viewer->state=VIEWER_AUTH;
+        EPHYR_DBG("viewer %d is sending cookie", v);
+    }
+    else
+    {
+        EPHYR_DBG("Warning: not checking viewer's cookie");
+        viewer->state=VIEWER_VERSION;
+        EPHYR_DBG("viewer %d is sending version", v);
+    }
+
+    if(!remoteVars.viewers_flush_thread_id)
+    {
+        if(pthread_create(&remoteVars.viewers_flush_thread_id, NULL, viewers_flush_thread, NULL))
+        {
+            EPHYR_DBG("ERROR; can't start flush thread for viewers");
+            remoteVars.viewers_flush_thread_id=0;
+            viewer->state=VIEWER_CLOSING;
+        }
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+
+#if XORG_VERSION_CURRENT >= 11900000
+    SetNotifyFd(sock, viewerReadNotify, X_NOTIFY_READ, NULL);
+#endif /* XORG_VERSION_CURRENT */
+    remoteVars.viewerTimer=TimerSet(remoteVars.viewerTimer, 0, 1000, checkViewers, NULL);
+    remote_check_viewers();
+}
+
+/*
+ * close all viewer connections, called from main thread when client disconnects
+ */
+void close_viewers(void)
+{
+    int v;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        if(remoteVars.viewers[v].state != VIEWER_FREE)
+            remoteVars.viewers[v].state=VIEWER_CLOSING;
+    }
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    remote_check_viewers();
+}
+
+/*
+ * called from main thread: closes connections of disconnected viewers,
+ * starts resync of caches for new viewers and repaints screen for viewers which joined
+ */
+void remote_check_viewers(void)
+{
+    BOOL resync=FALSE, repaint=FALSE;
+    int v;
+
+    if(!remoteVars.maxViewers)
+        return;
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    for(v=0;v<remoteVars.maxViewers;++v)
+    {
+        struct remoteViewer* viewer=&remoteVars.viewers[v];
+        //viewers are not getting frames sent over UDP
+        if(viewer->state != VIEWER_FREE && remoteVars.send_frames_over_udp)
+            viewer->state=VIEWER_CLOSING;
+        if((viewer->state == VIEWER_AUTH || viewer->state == VIEWER_VERSION) &&
+           GetTimeInMillis()-viewer->acceptTime >= VIEWER_AUTH_TIMEOUT)
+        {
+            EPHYR_DBG("viewer %d didn't send cookie or version in time", v);
+            viewer->state=VIEWER_CLOSING;
+        }
+        if(viewer->state != VIEWER_CLOSING)
+            continue;
+#if XORG_VERSION_CURRENT >= 11900000
+        RemoveNotifyFd(viewer->sock);
+#endif /* XORG_VERSION_CURRENT */
+        shutdown(viewer->sock, SHUT_RDWR);
+        close(viewer->sock);
+        viewer->sock=-1;
+        viewer->outbuf.start=viewer->outbuf.length=0;
+        viewer->state=VIEWER_FREE;
+        EPHYR_DBG("viewer %d closed", v);
+    }
+    if(remoteVars.viewerResyncRequested && time(NULL)-remoteVars.lastViewerResync >= VIEWER_RESYNC_DELAY)
+    {
+        remoteVars.viewerResyncRequested=FALSE;
+        resync=TRUE;
+    }
+    repaint=remoteVars.viewerRepaint;
+    remoteVars.viewerRepaint=FALSE;
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+
+    if(resync)
+    {
+        //client and viewers are getting reinit notification and the new data after it
+        EPHYR_DBG("resync caches for viewers");
+        remoteVars.lastViewerResync=time(NULL);
+        rebuild_caches();
+    }
+    if(repaint)
+    {
+        pthread_mutex_lock(&remoteVars.mainimg_mutex);
+        if(remoteVars.main_img)
+        {
+            pthread_mutex_unlock(&remoteVars.mainimg_mutex);
+            add_frame(remoteVars.main_img_width, remoteVars.main_img_height, 0, 0, 0, 0, 0);
+        }
+        else
+            pthread_mutex_unlock(&remoteVars.mainimg_mutex);
+    }
+}
+
+/*
+ * data for client socket is added to output buffer and written by flush thread,
+ * so the calling thread is never blocked by slow client
+ */
 ssize_t
 remote_write_socket(int fd, const void *buf, size_t count)
 {
+    struct iovec iov;
+
+    iov.iov_base=(void*)buf;
+    iov.iov_len=count;
     remoteVars.lastServerKeepAlive=time(NULL);
-    return write(fd,buf,count);
+    if(fd != remoteVars.clientsock_tcp)
+        return write(fd,buf,count);
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    if(remoteVars.outbuf.closed)
+    {
+        pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+        errno=EPIPE;
+        return -1;
+    }
+    if(remoteVars.outbuf.length+count > OUTBUF_MAX_BACKLOG ||
+       !outbuf_append(&remoteVars.outbuf, buf, count))
+    {
+        outbuf_overflow();
+        pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+        errno=EPIPE;
+        return -1;
+    }
+    pthread_cond_signal(&remoteVars.outbuf_cond);
+    viewers_append(&iov, 1);
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    return count;
+}
+
+/*
+ * add all buffers from iov to output buffer at once, so the message can't be
+ * mixed with data from other threads. Returns amount of bytes or -1 on error
+ */
+ssize_t
+remote_writev_socket(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t total=0;
+    int i;
+
+    remoteVars.lastServerKeepAlive=time(NULL);
+    if(fd != remoteVars.clientsock_tcp)
+        return writev(fd, iov, (iovcnt>IOV_MAX)?IOV_MAX:iovcnt);
+
+    pthread_mutex_lock(&remoteVars.outbuf_mutex);
+    if(remoteVars.outbuf.closed)
+    {
+        pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+        errno=EPIPE;
+        return -1;
+    }
+    for(i=0;i<iovcnt;++i)
+    {
+        total+=iov[i].iov_len;
+    }
+    if(remoteVars.outbuf.length+total > OUTBUF_MAX_BACKLOG)
+    {
+        outbuf_overflow();
+        pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+        errno=EPIPE;
+        return -1;
+    }
+    for(i=0;i<iovcnt;++i)
+    {
+        if(!outbuf_append(&remoteVars.outbuf, iov[i].iov_base, iov[i].iov_len))
+        {
+            outbuf_overflow();
+            pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+            errno=EPIPE;
+            return -1;
+        }
+    }
+    pthread_cond_signal(&remoteVars.outbuf_cond);
+    viewers_append(iov, iovcnt);
+    pthread_mutex_unlock(&remoteVars.outbuf_mutex);
+    return total;
 }
@@ -83,10 +83,14 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <fcntl.h>
 
 #include <stdint.h>
 #include <x264.h>
@@ -103,17 +107,110 @@
 //Changes 5 - 6: support for rootless mode
 //Changes 6 - 7: Sending KEYRELEASE immediately after KEYPRESS to avoid the "key sticking"
 //Changes 7 - 8: support for UDP sockets
-
-#define FEATURE_VERSION 8
+//Changes 8 - 9: receiving UDP datagrams bigger than UDPDGRAMSIZE
+//Changes 9 - 10: recovering lost frame datagrams from parity datagrams
+//Changes 10 - 11: requesting lost frame datagrams with RESENDDGRAMS event
+//Changes 11 - 12: input events are carrying input id, frames are carrying id of the input which caused them
+//Changes 12 - 13: sending events with variable length after EVPROTOCOL event
+//Changes 13 - 14: window names and icons in WINUPDATE are referenced by crc, data is sent only if client doesn't have it
+//Changes 14 - 15: WINUPDATE is carrying only changed fields of window, coded as varints
+//Changes 15 - 16: datagrams bigger than UDPDGRAMSIZE are sent only after client acknowledged probe datagram of this size with MTUPROBEACK
+//Changes 16 - 17: interrupted transfer of selection is aborted with empty last chunk with total size 0
+
+#define FEATURE_VERSION 17
 
 #define MAXMSGSIZE 1024*16
 
-//max size for UDP dgram 1200 (experimental value for VPN, maybe we should determine the MTU size later)
+//initial size of output buffer for client socket, the buffer grows if more space is needed
+#define OUTBUFSIZE 1024*256
+
+//if more data is waiting in output buffer, client is not reading fast enough.
+//New frames are not sent till the buffer is drained, queued frames are replaced by newer ones
+#define OUTBUF_CONGESTION_LIMIT 1024*1024*2
+
+//wake up after this time to check if congested connection is ready for the next frame
+#define OUTBUF_RETRY_DELAY 20 //msec
+
+//client which is not reading the data is disconnected when so much data is waiting in output buffer
+#define OUTBUF_MAX_BACKLOG 1024*1024*64
+
+//max amount of view only clients watching the session together with client
+#define MAXVIEWERS 8
+//viewer with more data waiting is not reading fast enough and is disconnected
+#define VIEWER_BACKLOG_LIMIT 1024*1024*8
+//min time between resyncs of caches requested for new viewers
+#define VIEWER_RESYNC_DELAY 5 //sec
+//viewer should send cookie and CLIENTVERSION event in this time after connection
+#define VIEWER_AUTH_TIMEOUT 5000 //msec
+
+//max amount of buffers for one writev call
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//max size for UDP dgram 1200 (experimental value for VPN), clients with version < 9 can't receive bigger dgrams
 #define UDPDGRAMSIZE 1200
 
+//dgram size is the biggest size acknowledged by client and allowed by path MTU of UDP socket, it's limited by these values
+#define UDPMINDGRAMSIZE 508
+#define UDPMAXDGRAMSIZE 1472
+
+//probing of bigger dgram size: interval between probes, amount of probes of one size
+//and the difference between acknowledged and failed size when probing stops
+#define MTUPROBE_INTERVAL 500 //msec
+#define MTUPROBE_RETRIES 3
+#define MTUPROBE_MIN_STEP 16
+
+//IPv4 header + UDP header
+#define UDPIPHEADERSIZE (20+8)
+
+//amount of datagrams which are prepared and sent with one system call
+#define UDPBATCHSIZE 32
+
 //UDP Server DGRAM Header - 4B checksum + 2B packet seq number + 2B amount of datagrams + 2B datagram seq number + 1B type
 #define SRVDGRAMHEADERSIZE (4+2+2+2+1)
 
+//parity dgram payload header - 2B amount of dgrams in group + 2B XOR of data length of all dgrams in group
+#define FECHEADERSIZE (2+2)
+
+//max amount of dgrams protected by one parity dgram
+#define FECMAXGROUP 32
+
+//loss rate is checked after sending this amount of frame packets over UDP
+#define FEC_CHECK_PACKETS 128
+
+//pacing of UDP dgrams, rate in bytes per second
+#define PACE_START_RATE 1024*1024*4
+#define PACE_MIN_RATE 1024*256
+#define PACE_MAX_RATE 1024*1024*128
+//max amount of bytes which can be sent at once after idle time
+#define PACE_BURST 1024*64
+//how often the rate is updated from RTT and loss
+#define PACE_UPDATE_INTERVAL 100 //msec
+//min RTT is measured again after this time, path can change
+#define PACE_MINRTT_INTERVAL 10000 //msec
+
+//max amount of dgrams which client can request in one RESENDDGRAMS event
+#define RESENDDGRAMS_MAX 16
+
+//recently sent frame packets are stored to resend lost dgrams without compressing frames again
+#define RETRANS_STORE_SIZE 64
+#define RETRANS_STORE_MAXBYTES 1024*1024*16
+
+//stages of input-to-display latency: from input to damage, compressing of frame, waiting in queue, sending
+enum LatencyStage{LAT_DAMAGE, LAT_ENCODE, LAT_QUEUE, LAT_SEND, LAT_TOTAL, LAT_STAGES};
+//bucket i is counting latencies < 2^i msec, last bucket is counting the rest
+#define LAT_BUCKETS 12
+//input which didn't cause any damage during this time is not tracked anymore
+#define LATENCY_INPUT_TIMEOUT 1000 //msec
+//how often latency histograms are written to file
+#define LATENCY_DUMP_INTERVAL 10 //sec
+
+//frames caused by key press or click during this time are sent before other frames in queue
+#define INPUT_BOOST_TIME 150 //msec
+//BOOST_FAST: boosted frames are compressed without searching for common regions in cache
+enum InputBoost{BOOST_NONE, BOOST_ON, BOOST_FAST};
+
 //port to listen by default
 #define DEFAULT_PORT 15000
 
@@ -152,13 +249,62 @@ enum WinState{WIN_UNCHANGED, WIN_DELETED, WIN_ICONIFIED};
 enum ServerDgramTypes{
     ServerFramePacket, //dgram belongs to packet representing frame
     ServerRepaintPacket, // dgram belongs to packet with screen repaint and the loss can be ignored
+    ServerParityPacket, // XOR of group of dgrams from frame packet, client can recover one lost dgram of the group
+    ServerProbePacket, // padded dgram of probed size, client acknowledges it with MTUPROBEACK event
 };
 
+//forward error correction for frame packets sent over UDP
+enum FecMode{FEC_NONE, FEC_ADAPTIVE, FEC_FIXED};
+
 
 //Size of 1 window update (new or changed window) = 4xwinId + type of update + 7 coordinates + visibility + type of window + size of name buffer + icon_size
 #define WINUPDSIZE 4*sizeof(uint32_t) + sizeof(int8_t) + 7*sizeof(int16_t) + sizeof(int8_t) + sizeof(int8_t) + sizeof(int16_t) + sizeof(int32_t)
 //Size of 1 window update (deleted window) = winId + type of update
 #define WINUPDDELSIZE sizeof(uint32_t) + sizeof(int8_t)
+//since version 14 update is carrying crc of name and crc of icon
+#define WINUPDCRCSIZE 2*sizeof(uint32_t)
+//amount of names and icons client keeps. Client should keep the last WINCACHESIZE names and icons it received with data.
+//Server keeps the icon of every window, so it's sent again when it's not in cache anymore
+#define WINCACHESIZE 256
+
+//since version 15 changed window is sent as id, state, uint16 mask of fields and fields which are set in mask.
+//Ids are varints, geometry fields are zigzag varints of difference to the last sent value,
+//visibility and type are 1 byte, name is crc, varint size and data, icon is crc, varint size and data.
+//Size of data is 0 if client has name or icon with this crc
+enum WindowField{
+    WINFIELD_PARENT=1<<0,
+    WINFIELD_NEXTSIB=1<<1,
+    WINFIELD_TRANSWIN=1<<2,
+    WINFIELD_X=1<<3,
+    WINFIELD_Y=1<<4,
+    WINFIELD_W=1<<5,
+    WINFIELD_H=1<<6,
+    WINFIELD_MINW=1<<7,
+    WINFIELD_MINH=1<<8,
+    WINFIELD_BW=1<<9,
+    WINFIELD_VISIBILITY=1<<10,
+    WINFIELD_TYPE=1<<11,
+    WINFIELD_NAME=1<<12,
+    WINFIELD_ICON=1<<13
+};
+//new window is carrying all fields except name and icon, they are sent if window has them
+#define WINFIELD_ALL 0x0FFF
+//max size of one window update without name and icon data
+#define WINUPDDELTASIZE sizeof(uint32_t) + sizeof(int8_t) + sizeof(uint16_t) + 12*5 + 2*(sizeof(uint32_t)+5)
+
+//size of hash table for rootless windows, should be power of 2
+#define WINHASHSIZE 256
+//if more windows are changed between two checks, check the whole windows tree
+#define DIRTYWINDOWS_MAX 128
+//how often position and size of windows are sent while window is moved or resized
+#define WINUPDATE_RATE 20 //per second
+
+//size of hash tables for cursors, should be power of 2
+#define CURSORHASHSIZE 256
+//cursor which is not used anymore is deleted on client after this time, if the same image is not used again
+#define CURSOR_RELEASE_TIME 10000 //msec
+//max amount of not used cursors waiting for deletion
+#define CURSOR_RELEASED_MAX 64
 
 #define DEFAULT_COMPRESSION JPEG
 
@@ -171,6 +317,20 @@ enum ServerDgramTypes{
 
 #define CACHEMAXELEMENTS 50 //store max 50 elements in cache
 
+//classes of outgoing messages, send thread is choosing the next message according to the weight of the class
+enum SendClass{SEND_CURSOR, SEND_FRAME, SEND_REFINE, SEND_SELECTION, SEND_BULK, SEND_CLASSES};
+
+//default weights of send classes, every class gets the share of bandwidth proportional to it's weight
+//can be changed with "sendweights" option, for example sendweights=16:8:2:4:1
+#define CURSOR_WEIGHT 16
+#define FRAME_WEIGHT 8
+#define REFINE_WEIGHT 2
+#define SELECTION_WEIGHT 4
+#define BULK_WEIGHT 1
+
+//start to refine screen regions if no frames were sent during this time
+#define REFINE_DELAY 100 //msec
+
 //Events
 #define KEYPRESS 2
 #define KEYRELEASE 3
@@ -191,10 +351,23 @@ enum ServerDgramTypes{
 #define RESENDFRAME 16
 //client is requesting UDP port for frames
 #define OPENUDP 17
+//ask to resend lost dgrams of frame packet
+#define RESENDDGRAMS 18
+//client is switching to framed events, every next event has a length header and no padding to EVLENGTH
+#define EVPROTOCOL 19
+//client received probe datagram
+#define MTUPROBEACK 20
 
 
 #define EVLENGTH 41
 
+//version of framed events protocol supported by server
+#define EVPROTOCOL_VERSION 1
+//framed event header - 4B length of event
+#define EVFRAMEHEADERSIZE 4
+//max length of one framed event, client is sending bigger data in several events
+#define EVMAXFRAMEDLENGTH 1024*1024*4
+
 //width of screen region
 #define SCREEN_REG_WIDTH 40
 
@@ -250,6 +423,31 @@ struct frame_region
     point_t source_coordinates;
 };
 
+//ring buffer with data waiting to be written to client socket
+struct OutputBuffer
+{
+    unsigned char* data;
+    size_t size; //allocated size
+    size_t start; //position of first byte to write
+    size_t length; //amount of bytes waiting in buffer
+    BOOL closed; //connection is closing, flush thread should exit
+};
+
+//view only client, it's getting a copy of data sent to client
+struct remoteViewer
+{
+    enum {VIEWER_FREE, VIEWER_AUTH, VIEWER_VERSION, VIEWER_PENDING, VIEWER_ACTIVE, VIEWER_CLOSING} state;
+    int sock;
+    //cookie and CLIENTVERSION event are read without blocking main thread, used only by main thread
+    char cookie[32];
+    int cookieBytes;
+    char versionEvent[EVLENGTH];
+    int versionBytes;
+    CARD32 acceptTime;
+    struct OutputBuffer outbuf;
+    BOOL versionSent;
+};
+
 //elemnet of the dgram list
 struct dgram_element
 {
@@ -281,10 +479,28 @@ struct cursorFrame
 
 };
 
+//unique cursor image sent to client, all X cursors with the same image are using it
+struct cursorEntry
+{
+    uint32_t hash; //crc of image, hotspot and colors
+    uint32_t id; //serial number of the first cursor with this image, client knows cursor by this number
+    uint32_t refs; //amount of X cursors using this image
+    uint16_t width, height, xhot, yhot;
+    BOOL argb;
+    uint8_t colors[6]; //foreground and background colors of core cursor
+    char* bits; //copy of cursor image to compare cursors with the same hash
+    uint32_t bitsSize;
+    uint32_t releaseTime; //when cursor was released by the last X cursor
+    BOOL released; //cursor is in the list of released cursors
+    struct cursorEntry* hashNext;
+    struct cursorEntry* releasedNext;
+};
+
 struct sentCursor
 {
     uint32_t serialNumber;
-    struct sentCursor* next;
+    struct cursorEntry* entry;
+    struct sentCursor* next; //next element in hash chain
 };
 
 //we need to delete cursor on client when XServer deleting cursor
@@ -322,6 +538,27 @@ struct deleted_elem
     uint32_t crc;
 };
 
+//frame packet which was sent over UDP
+struct sent_packet
+{
+    unsigned char* data;
+    uint32_t length;
+    uint32_t crc;
+    uint16_t seq;
+    uint16_t payloadSize; //size of data in one dgram
+    uint16_t dgInPack;
+};
+
+//client's request to resend frame or lost dgrams of packet
+struct resend_request
+{
+    struct resend_request* next;
+    uint32_t crc; //frame from cache if count is 0
+    uint16_t seq;
+    uint16_t count;
+    uint16_t dgrams[RESENDDGRAMS_MAX];
+};
+
 struct sendqueue_element
 {
     struct cache_elem* frame;
@@ -329,9 +566,21 @@ struct sendqueue_element
     uint32_t width, height;
     uint32_t crc;
     uint32_t winId;
+    //input which caused this frame and times of processing stages in usec
+    uint32_t inputId;
+    uint64_t inputTime, damageTime, queueTime;
+    //frame is caused by recent input and should be sent before other frames
+    BOOL boosted;
     struct sendqueue_element* next;
 };
 
+//zlib level for text chunks of output selection, fast compression lets us start sending at once
+#define SELECTION_COMPRESSION_LEVEL Z_BEST_SPEED
+//selection thread pauses reading of INCR selection while more compressed data is waiting in the queue of output chunks
+#define SELECTION_PIPELINE_SIZE 1024*1024*2
+//incoming selections bigger than this are stored in temporary file, only this amount of data stays in memory
+#define SELECTION_SPOOL_WINDOW 1024*1024*8
+
 //chunk of data with output selection
 struct OutputChunk
 {
@@ -342,7 +591,7 @@ struct OutputChunk
     BOOL firstChunk; // if it's a first chunk in selection
     BOOL lastChunk;  // if it's a last chunk in selection
     enum SelectionType selection; //PRIMARY or CLIPBOARD
-    uint32_t totalSize; //the total size of the selection data
+    uint32_t totalSize; //the total size of the selection data, 0 in the last chunk if transfer is aborted
     struct OutputChunk* next; //next chunk in the queue
 };
 
@@ -357,6 +606,11 @@ struct InputBuffer
     uint32_t currentChunkCompressedSize; //if chunk is compressed, size of compressed data
     unsigned char* currentChunkCompressedData; //if chunk is compressed, compressed dat will be stored here
     enum SelectionMime mimeData; //UTF_STRING or PIXMAP
+    unsigned char* pngData; //image converted to PNG when X client requested it, NULL if not converted
+    uint32_t pngSize;
+    BOOL spooled; //data is mapped from temporary file
+    int spoolFd; //descriptor of temporary file
+    uint32_t spoolReleased; //data before this offset is written to file and released from memory
     xcb_timestamp_t timestamp; //ts when we own selection
     BOOL owner; //if we are the owners of selection
     enum {NOTIFIED, REQUESTED, COMPLETED} state;
@@ -379,6 +633,8 @@ struct IncrTransaction
     char* data;
     uint32_t size;
     uint32_t sentBytes;
+    int spoolFd; //if data is mapped from temporary file of input selection, -1 otherwise
+    uint32_t spoolReleased; //sent data before this offset is released from memory
     xcb_timestamp_t timestamp;
     struct IncrTransaction* next;
 };
@@ -398,9 +654,24 @@ struct SelectionStructure
     BOOL clientSupportsExetndedSelection; //if client supports extended selection - sending selection in several chunks for big size data
     BOOL clientSupportsOnDemandSelection; //if client supports selection on demand - sending data only if client requests it
     xcb_atom_t incrAtom; //mime type of the incr selection we are reading
+    xcb_atom_t incrSelection; //selection of the incr property we are reading
     xcb_atom_t currentSelection; //selection we are currently reading
     struct OutputChunk* firstOutputChunk; //the first and last elements of the
     struct OutputChunk* lastOutputChunk;  //queue of selection chunks
+    uint32_t outputChunkBytes; //size of data in the queue of selection chunks
+    //reading of INCR property is paused while queue is bigger than SELECTION_PIPELINE_SIZE, protected by selection_mutex
+    xcb_atom_t incrPausedProperty; //property which is not deleted yet, 0 if reading is not paused
+    BOOL incrResumeSent; //send thread asked selection thread to continue reading
+    int compressionLevel; //zlib level for text chunks, 0 - don't compress
+    uint32_t spoolWindow; //incoming selections bigger than this are spooled to temporary file, 0 - keep all in memory
+    //crc, size and type of the last selection which was completely queued for client, protected by selection_mutex
+    BOOL lastSentValid[2];
+    uint32_t lastSentCrc[2];
+    uint32_t lastSentSize[2];
+    xcb_atom_t lastSentType[2];
+    //first chunk of selection was sent, but not the last one yet. Type of this selection. Protected by selection_mutex
+    BOOL outputInProgress[2];
+    enum SelectionMime outputInProgressMime[2];
     xcb_atom_t best_atom[2]; //the best mime type for selection to request on demand sel request from client
     BOOL requestSelection[2]; //selection thread will set it to TRUE if the selection need to be requested
 
@@ -431,13 +702,46 @@ struct remoteWindow
     char* name;
     unsigned char* icon_png;
     uint32_t icon_size;
+    //crc of name and of icon data, 0 if window doesn't have it
+    uint32_t nameCrc, iconCrc;
+    //client doesn't have the name yet, send it with next update
+    BOOL sendName;
+    //client doesn't have the icon, send it with next update
+    BOOL sendIcon;
+    //fields which are different from the last sent state
+    uint16_t updateFields;
+    //client knows the window
+    BOOL known;
+    //client iconified the window, but it's still mapped on server, damage of window is not sent
+    BOOL clientHidden;
+    //window was damaged while hidden, repaint it when client shows it again
+    BOOL damageDeferred;
+    //the state of window which was sent to client the last time
+    struct
+    {
+        uint32_t parentId, nextSibId, transWinId;
+        int16_t x,y;
+        uint16_t w,h,bw, minw, minh;
+        int8_t visibility;
+        uint8_t winType;
+        uint32_t nameCrc, iconCrc;
+    }sent;
     BOOL foundInWinTree;
     uint32_t id;
     uint32_t parentId, nextSibId, transWinId;
     struct remoteWindow *next;
+    //next window with the same hash
+    struct remoteWindow *hashNext;
     WindowPtr ptr, parent, nextSib;
 };
 
+//window which should be checked for updates in rootless mode
+struct dirtyWindow
+{
+    WindowPtr win;
+    BOOL children; //check the children of window instead of window itself
+};
+
 typedef struct{
   int raw_frame_size;
   x264_picture_t pic;
@@ -459,6 +763,8 @@ struct _remoteHostVars
     BOOL nxagentMode;
     char optionsFile[256];
     char stateFile[256];
+    //file for latency histograms, empty if histograms are not written
+    char latencyFile[256];
     char acceptAddr[256];
     char cookie[33];
     char displayName[256];
@@ -470,8 +776,12 @@ struct _remoteHostVars
     uint32_t framenum_sent;
     uint32_t eventnum;
     uint32_t eventbytes;
-    char eventBuffer[EVLENGTH*100];
+    //events from client, buffer grows if framed event doesn't fit
+    char* eventBuffer;
+    uint32_t eventBufferSize;
     uint32_t evBufferOffset;
+    //client is sending framed events with variable length
+    BOOL framedEvents;
 
     unsigned long send_thread_id;
 
@@ -502,6 +812,21 @@ struct _remoteHostVars
 
     int clientsock_tcp, serversock_tcp, sock_udp;
     BOOL rootless;
+    //process every motion event from client, don't collapse them to the latest position
+    BOOL motionHistory;
+
+    //last input event which didn't cause a frame yet, used only by main thread
+    uint32_t pendingInputId;
+    uint64_t pendingInputTime; //usec, 0 if no input is pending
+    //send frames caused by key press or click before other frames
+    enum InputBoost inputBoost;
+    //time of last key press or click, used only by main thread
+    uint64_t lastBoostInputTime; //usec
+    //id of input which caused the frame being sent, used only by send thread
+    uint32_t frameInputId;
+    //input-to-display latency histograms, protected by cache_mutex
+    uint32_t latencyHist[LAT_STAGES][LAT_BUCKETS];
+    time_t lastLatencyDump;
 
     //array of screen regions
     screen_region* screen_regions;
@@ -519,6 +844,15 @@ struct _remoteHostVars
     struct deleted_elem* last_deleted_elements;
     uint32_t deleted_list_size;
 
+    //requests from client to resend frames or dgrams, protected by cache_mutex
+    struct resend_request* first_resend_request;
+    struct resend_request* last_resend_request;
+
+    //recently sent frame packets, used only by send thread
+    struct sent_packet retransStore[RETRANS_STORE_SIZE];
+    int retransNext;
+    uint32_t retransBytes;
+
 
     struct deletedCursor* first_deleted_cursor;
     struct deletedCursor* last_deleted_cursor;
@@ -530,16 +864,98 @@ struct _remoteHostVars
     struct cursorFrame* firstCursor;
     struct cursorFrame* lastCursor;
 
-    struct sentCursor* sentCursorsHead;
-    struct sentCursor* sentCursorsTail;
+    //X cursors by serial number and sent cursor images by hash, protected by cursor_mutex
+    struct sentCursor* sentCursorHash[CURSORHASHSIZE];
+    struct cursorEntry* cursorHash[CURSORHASHSIZE];
+    //cursor images without X cursors, they are deleted on client later
+    struct cursorEntry* firstReleasedCursor;
+    uint32_t releasedCursors;
 
     struct remoteWindow* windowList;
+    //min time between updates which are changing only position or size of windows, 0 - no limit
+    uint32_t winUpdateInterval; //msec
+    long lastWinUpdateTime;
+    //windows from list by pointer
+    struct remoteWindow* windowHash[WINHASHSIZE];
+    //crcs of names and icons which were sent to client, protected by sendqueue_mutex
+    uint32_t sentWinNames[WINCACHESIZE];
+    uint32_t sentWinIcons[WINCACHESIZE];
+    int sentWinNamesNext, sentWinIconsNext;
     BOOL windowsUpdated;
-
+    //windows changed since last check, used only by main thread
+    struct dirtyWindow dirtyWindows[DIRTYWINDOWS_MAX];
+    int dirtyWindowsCount;
+    //list of windows was cleaned or too many windows are changed, check the whole tree
+    BOOL windowsFullCheck;
+
+    /* sendqueue_mutex can be locked before one of cache_mutex, cursor_mutex or selection_mutex,
+     * never after them. Only one of cache_mutex, cursor_mutex and selection_mutex can be locked at the same time.
+     * Don't write to socket with any of this mutexes locked.
+     */
+    //frame queue, windows list and connection state
     pthread_mutex_t sendqueue_mutex;
+    //frame cache, busy counters of cache elements, list of deleted elements and resend requests
+    pthread_mutex_t cache_mutex;
+    //cursor queue, lists of sent and deleted cursors
+    pthread_mutex_t cursor_mutex;
+    //output selection chunks and selection requests
+    pthread_mutex_t selection_mutex;
     pthread_mutex_t mainimg_mutex;
     pthread_cond_t have_sendqueue_cond;
 
+    //outgoing data for TCP client socket. Producers only append data, flush thread writes it to non-blocking socket
+    struct OutputBuffer outbuf;
+
+    //datagrams are prepared here before sending, used only by send thread
+    unsigned char dgramSlab[UDPBATCHSIZE][UDPMAXDGRAMSIZE];
+    //size of UDP dgram for current session
+    uint16_t udpDgramSize;
+    //probing of bigger dgram size, protected by sendqueue_mutex
+    uint16_t udpConfirmedSize; //the biggest dgram size acknowledged by client
+    uint16_t udpProbeMax; //the biggest size which can be acknowledged yet
+    uint16_t udpProbeSize; //size which is probed now, 0 - not probing
+    uint16_t udpProbeId;
+    int udpProbesSent; //amount of probes of udpProbeSize
+    long udpProbeTime; //time of the last probe
+    BOOL udpResizePending; //send thread should update dgram size
+    //payload of probe dgrams, always zero
+    unsigned char udpProbePadding[UDPMAXDGRAMSIZE];
+
+    //parity of current dgram group, used only by send thread
+    unsigned char fecParity[UDPMAXDGRAMSIZE];
+    enum FecMode fecMode;
+    //amount of dgrams in one parity group, 0 - don't send parity dgrams
+    uint16_t fecGroupSize;
+    //frame packets sent since last check of loss rate
+    uint32_t fecPackets;
+    //frames which client asked to resend over UDP, increased by main thread
+    uint32_t udpLostPackets;
+    uint32_t fecLostChecked;
+
+    //pacing of UDP dgrams, used only by send thread
+    uint32_t paceRate;
+    int64_t paceTokens;
+    uint64_t paceLastRefill; //usec
+    long paceLastUpdate; //msec
+    BOOL paceLimited; //sender was waiting for tokens since last rate update
+    uint32_t paceLostChecked;
+    uint32_t paceMinRtt; //usec
+    long paceMinRttTime; //msec
+    pthread_mutex_t outbuf_mutex;
+    pthread_cond_t outbuf_cond;
+    pthread_t flush_thread_id;
+
+    //view only clients, protected by outbuf_mutex. Viewers are sharing frames and caches of client,
+    //new viewer waits in pending state till caches are resynced
+    struct remoteViewer viewers[MAXVIEWERS];
+    int maxViewers; //0 - only one client can connect
+    pthread_cond_t viewers_cond;
+    pthread_t viewers_flush_thread_id;
+    BOOL viewerResyncRequested;
+    BOOL viewerRepaint; //viewers joined after resync, repaint the whole screen
+    OsTimerPtr viewerTimer; //closes viewers which are not sending cookie and starts delayed resync
+    time_t lastViewerResync; //used only by main thread
+
     socklen_t tcp_addrlen, udp_addrlen;
     struct sockaddr_in tcp_address, udp_address;
 
@@ -551,6 +967,14 @@ struct _remoteHostVars
     //if all cache are cleared and notofictaion to client should be send
     BOOL cache_rebuilt;
 
+    //weights of send classes and amount of data sent by every class divided by it's weight
+    uint32_t sendWeight[SEND_CLASSES];
+    uint64_t sendPass[SEND_CLASSES];
+    //pass of the last scheduled class
+    uint64_t sendVTime;
+    //time when last frame was sent
+    long lastFrameTime;
+
     struct SelectionStructure selstruct;
 } ;
 
@@ -562,7 +986,7 @@ int send_packet_as_datagrams(unsigned char* data, uint32_t length, uint8_t dgTyp
 void set_client_version(uint16_t ver, uint16_t os);
 
 void readInputSelectionBuffer(char* buff);
-void readInputSelectionHeader(char* buff);
+void readInputSelectionHeader(char* buff, uint32_t length);
 
 #if XORG_VERSION_CURRENT < 11900000
 void pollEvents(void);
@@ -580,6 +1004,11 @@ void restartTimerOnInit(void);
 
 void open_socket(void);
 void open_udp_socket(void);
+void update_udp_dgram_size(void);
+void start_mtu_probing(void);
+void send_mtu_probe(void);
+void process_mtu_probe_ack(uint16_t id, uint16_t size);
+void reset_udp_pacing(void);
 void close_server_socket(void);
 
 void close_client_sockets(void);
@@ -603,6 +1032,8 @@ unsigned char* jpeg_compress(int quality, uint32_t image_width, uint32_t image_h
 unsigned char* png_compress(uint32_t image_width, uint32_t image_height,
                              unsigned char* RGBA_buffer, uint32_t* png_size, BOOL compress_cursor);
 
+long MyGetTickCount(void);
+
 void clientReadNotify(int fd, int ready, void *data);
 void serverAcceptNotify(int fd, int ready, void *data);
 
@@ -610,6 +1041,7 @@ void add_frame(uint32_t width, uint32_t height, int32_t x, int32_t y, uint32_t c
 
 
 void clear_output_selection(void);
+void remove_output_selection(enum SelectionType sel);
 
 void disconnect_client(void);
 
@@ -657,9 +1089,12 @@ void client_win_change(char* buff);
 void client_win_close(uint32_t winId);
 void client_win_iconify(uint32_t winId);
 void remote_check_rootless_windows_for_updates(KdScreenInfo *screen);
+void remote_window_changed(WindowPtr win);
+void remote_window_children_changed(WindowPtr parent);
+void remote_window_destroyed(WindowPtr win);
 void markDirtyRegions(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t jpegQuality, uint32_t winId);
 int getDirtyScreenRegion(void);
-void send_dirty_region(int index);
+uint32_t send_dirty_region(int index);
 unsigned int checkClientAlive(OsTimerPtr timer, CARD32 time_card, void* args);
 void send_srv_disconnect(void);
 BOOL insideOfRegion(struct PaintRectRegion* reg, int x , int y);
@@ -668,8 +1103,25 @@ BOOL unitePaintRegions(struct PaintRectRegion* firstRegion);
 //perform cleanup of all caches and queues when disconnecting or performing reinitialization
 void clean_everything(void);
 void resend_frame(uint32_t crc);
+void add_resend_request(uint32_t crc, uint16_t seq, uint16_t count, uint16_t* dgrams);
+void remote_input_received(uint32_t inputId);
+void remote_boost_input(void);
+BOOL remote_input_boost_active(void);
+uint32_t process_resend_requests(void);
+void clear_resend_requests(void);
+void clear_retransmission_store(void);
 ssize_t remote_write_socket(int fd, const void *buf, size_t count);
+ssize_t remote_writev_socket(int fd, struct iovec *iov, int iovcnt);
+void start_output_flushing(void);
+void stop_output_flushing(BOOL wait);
+void accept_viewer(void);
+BOOL activate_pending_viewers(void);
+void close_viewers(void);
+void remote_check_viewers(void);
+size_t remote_output_backlog(void);
+BOOL remote_output_congested(void);
 void sendServerAlive(void);
+void remote_wakeup_send_thread(void);
 
 //aditional
 void encode_main_img(void);
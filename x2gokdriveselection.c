@@ -35,6 +35,10 @@
 #include <string.h>
 #include <png.h>
 #include <zlib.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <setjmp.h>
 
 #ifdef HAVE_CONFIG_H
 #include <dix-config.h>
@@ -55,6 +59,8 @@ extern unsigned long long int debug_selectThreadId;
 
 #define SELECTION_DELAY 30000 //timeout for selection operation
 #define INCR_SIZE 256*1024 //size of part for incr selection incr selection
+#define MAX_CONVERT_IMAGE_SIZE 8192 //don't convert images with bigger width or height
+#define MAX_CONVERT_IMAGE_PIXELS 4096*4096 //don't convert images with more pixels, decoded image is taking CACHEBPP bytes per pixel
 
 static struct _remoteHostVars *remoteVars = NULL;
 
@@ -84,6 +90,9 @@ static xcb_atom_t ATOM_IMAGE_JPEG;
 static xcb_atom_t ATOM_PIXMAP;
 static xcb_atom_t ATOM_IMAGE_BMP;
 
+//formats of image files we can get from client
+enum ImageFormat{IMAGE_UNKNOWN, IMAGE_PNG, IMAGE_JPEG, IMAGE_BMP};
+
 
 uint32_t max_chunk(void)
 {
@@ -158,7 +167,13 @@ void destroy_incr_transaction(struct IncrTransaction* tr, struct IncrTransaction
     xcb_flush(remoteVars->selstruct.xcbConnection);
 
     //free data
-    free(tr->data);
+    if(tr->spoolFd != -1)
+    {
+        munmap(tr->data, tr->size);
+        close(tr->spoolFd);
+    }
+    else
+        free(tr->data);
 
     //remove element from list
     if(prev)
@@ -290,6 +305,24 @@ void process_delayed_requests(void)
     }
 }
 
+static
+void release_spooled_data(unsigned char* data, uint32_t* released, uint32_t done)
+{
+    //drop pages of mapped spool file before offset "done" from memory, the data stays in file
+    //doing it by portions of spool window to not call madvise on every chunk
+    uint32_t page=sysconf(_SC_PAGESIZE);
+    uint32_t end=done/page*page;
+    uint32_t window=remoteVars->selstruct.spoolWindow;
+
+    if(end <= *released || (end - *released < window/2))
+        return;
+    if(madvise(data + *released, end - *released, MADV_DONTNEED))
+    {
+        EPHYR_DBG("madvise failed for spooled selection");
+    }
+    *released=end;
+}
+
 void process_incr_transaction_property(xcb_property_notify_event_t * pn)
 {
     //process incr transactions
@@ -320,6 +353,11 @@ void process_incr_transaction_property(xcb_property_notify_event_t * pn)
             xcb_flush(remoteVars->selstruct.xcbConnection);
             tr->sentBytes+=sendingBytes;
             tr->timestamp=currentTime.milliseconds;
+            if(tr->spoolFd != -1)
+            {
+                //sent data is not needed in memory anymore
+                release_spooled_data((unsigned char*)tr->data, &tr->spoolReleased, tr->sentBytes);
+            }
             return;
         }
         prev=tr;
@@ -475,11 +513,7 @@ static xcb_atom_t best_atom_from_target(xcb_atom_t* list, size_t size)
 //         EPHYR_DBG( "selecting mime type image/xpm");
         return a;
     }
-    if((a=target_has_atom(list, size, ATOM_PIXMAP)))
-    {
-//         EPHYR_DBG( "selecting mime type PIXMAP");
-        return a;
-    }
+    //not selecting PIXMAP, it's an id of X pixmap and not the image data which we can forward to client
     if((a=target_has_atom(list, size, ATOM_IMAGE_BMP)))
     {
 //         EPHYR_DBG( "selecting mime type image/bmp");
@@ -498,6 +532,33 @@ static xcb_atom_t best_atom_from_target(xcb_atom_t* list, size_t size)
     return 0;
 }
 
+/*
+ * stop reading of INCR property, the next data from its owner is ignored.
+ * If client already got a part of this selection, the transfer is aborted, otherwise queued chunks are dropped
+ */
+static
+void cancel_incr_reading(void)
+{
+    BOOL reading=(remoteVars->selstruct.incrementalSize != 0);
+
+    remoteVars->selstruct.incrementalSize=remoteVars->selstruct.incrementalSizeRead=0;
+    remoteVars->selstruct.incrAtom=0;
+    pthread_mutex_lock(&remoteVars->selection_mutex);
+    //paused INCR reading is canceled
+    remoteVars->selstruct.incrPausedProperty=0;
+    if(reading)
+    {
+        EPHYR_DBG("reading of INCR property is canceled");
+        remove_output_selection(selection_from_atom(remoteVars->selstruct.incrSelection));
+    }
+    pthread_mutex_unlock(&remoteVars->selection_mutex);
+    if(reading)
+    {
+        //chunk which aborts the transfer could be added
+        remote_wakeup_send_thread();
+    }
+}
+
 void request_selection_data( xcb_atom_t selection, xcb_atom_t target, xcb_atom_t property, xcb_timestamp_t t)
 {
     //execute convert selection for primary or clipboard to get mimetypes or data (depends on target atom)
@@ -511,6 +572,53 @@ void request_selection_data( xcb_atom_t selection, xcb_atom_t target, xcb_atom_t
     xcb_flush(remoteVars->selstruct.xcbConnection);
 }
 
+static
+BOOL selection_already_sent(xcb_atom_t selection, xcb_atom_t property, xcb_get_property_reply_t* reply, BOOL* dedup, uint32_t* crc, uint32_t* size)
+{
+    //calculate crc of complete property value, the rest of data which is not in reply is read from X server
+    //return TRUE if client already has the same data in this selection
+    //dedup is set to TRUE if we can remember crc of this selection after sending
+    xcb_get_property_cookie_t cookie;
+    xcb_get_property_reply_t *next_reply;
+    unsigned int bytes_left=reply->bytes_after;
+    uint32_t length;
+    enum SelectionType sel=selection_from_atom(selection);
+    BOOL sent;
+
+    *dedup=FALSE;
+    //in on demand mode client requests data only when it needs it,
+    //if client can change selection without telling us, we can't know what it has
+    if(remoteVars->selstruct.clientSupportsOnDemandSelection || remoteVars->selstruct.selectionMode != CLIP_BOTH)
+        return FALSE;
+    //incr selection we get only part by part
+    if(remoteVars->selstruct.incrementalSize && (remoteVars->selstruct.incrAtom==property))
+        return FALSE;
+
+    *size=xcb_get_property_value_length(reply);
+    *crc=crc32(crc32(0L, Z_NULL, 0), xcb_get_property_value(reply), *size);
+    while(bytes_left)
+    {
+        cookie= xcb_get_property(remoteVars->selstruct.xcbConnection, 0, remoteVars->selstruct.clipWinId, property, XCB_GET_PROPERTY_TYPE_ANY, *size/4, max_chunk());
+        next_reply=xcb_get_property_reply(remoteVars->selstruct.xcbConnection, cookie, NULL);
+        if(!next_reply)
+            return FALSE;
+        length=xcb_get_property_value_length(next_reply);
+        *crc=crc32(*crc, xcb_get_property_value(next_reply), length);
+        *size+=length;
+        bytes_left=next_reply->bytes_after;
+        free(next_reply);
+        if(!length)
+            break;
+    }
+    *dedup=TRUE;
+
+    pthread_mutex_lock(&remoteVars->selection_mutex);
+    sent=remoteVars->selstruct.lastSentValid[sel] && remoteVars->selstruct.lastSentCrc[sel] == *crc &&
+         remoteVars->selstruct.lastSentSize[sel] == *size && remoteVars->selstruct.lastSentType[sel] == reply->type;
+    pthread_mutex_unlock(&remoteVars->selection_mutex);
+    return sent;
+}
+
 void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
 {
     xcb_atom_t data_atom;
@@ -520,6 +628,10 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
     struct OutputChunk* chunk;
     unsigned char* compressed_data;
     uint32_t compressed_size;
+    BOOL dedup=FALSE;
+    BOOL paused=FALSE;
+    uint32_t crc=0, total_size=0;
+    xcb_atom_t data_type=0;
 
 
     //request property which represents value of selection (data or mime types)
@@ -555,6 +667,7 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
                 unsigned int sz=*((unsigned int*) xcb_get_property_value(reply));
 //                 EPHYR_DBG( "have incr property size: %d", sz);
                 remoteVars->selstruct.incrAtom=property;
+                remoteVars->selstruct.incrSelection=selection;
                 remoteVars->selstruct.incrementalSize=sz;
                 remoteVars->selstruct.incrementalSizeRead=0;
 
@@ -628,8 +741,15 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
             else
             {
                 //here we have selection as string or image
-                if(is_image_atom( reply->type) || is_string_atom( reply->type))
+                if((is_image_atom( reply->type) || is_string_atom( reply->type)) &&
+                   selection_already_sent(selection, property, reply, &dedup, &crc, &total_size))
                 {
+                    //don't send the same data again
+                    EPHYR_DBG("selection %d didn't change, not sending %d bytes", selection_from_atom(selection), total_size);
+                }
+                else if(is_image_atom( reply->type) || is_string_atom( reply->type))
+                {
+                    data_type=reply->type;
                     //read property data in loop in the chunks with size (100KB)
                     do
                     {
@@ -657,8 +777,10 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
                         {
                             chunk->mimeData=UTF_STRING;
                             //for text chunks > 1K using zlib compression if client supports it
-                            if(remoteVars->selstruct.clientSupportsExetndedSelection && chunk->size > 1024 && remoteVars->client_os != WEB )
+                            if(remoteVars->selstruct.clientSupportsExetndedSelection && chunk->size > 1024 && remoteVars->client_os != WEB &&
+                               remoteVars->selstruct.compressionLevel)
                             {
+                                //every chunk is compressed on its own while the next one is still in X server, so sending starts with the first chunk
                                 compressed_data=zcompress(chunk->data, chunk->size, &compressed_size);
                                 if(compressed_data && compressed_size)
                                 {
@@ -717,7 +839,17 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
 //                          EPHYR_DBG( "read chunk of selection - size %d, total read %d,  left %d, first:%d, last:%d", xcb_get_property_value_length(reply), bytes_read, bytes_left, chunk->firstChunk, chunk->lastChunk);
 
 
-                        pthread_mutex_lock(&remoteVars->sendqueue_mutex);
+                        pthread_mutex_lock(&remoteVars->selection_mutex);
+                        remoteVars->selstruct.outputChunkBytes+=(chunk->compressed_size)?chunk->compressed_size:chunk->size;
+                        //send thread has enough data to send, don't ask selection owner for the next chunk of INCR property
+                        //till the queue is drained, memory use for big selections stays bounded
+                        if(remoteVars->selstruct.incrAtom==property && !chunk->lastChunk &&
+                           remoteVars->selstruct.outputChunkBytes > SELECTION_PIPELINE_SIZE)
+                        {
+                            remoteVars->selstruct.incrPausedProperty=property;
+                            remoteVars->selstruct.incrResumeSent=FALSE;
+                            paused=TRUE;
+                        }
                         //attach chunk to the end of output chunk queue
                         if(!remoteVars->selstruct.lastOutputChunk)
                         {
@@ -729,10 +861,9 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
                             remoteVars->selstruct.lastOutputChunk=chunk;
                         }
                         EPHYR_DBG(" ADD CHUNK %p %p %p", remoteVars->selstruct.firstOutputChunk, remoteVars->selstruct.lastOutputChunk, chunk);
-                        pthread_cond_signal(&remoteVars->have_sendqueue_cond);
-
+                        pthread_mutex_unlock(&remoteVars->selection_mutex);
 
-                        pthread_mutex_unlock(&remoteVars->sendqueue_mutex);
+                        remote_wakeup_send_thread();
 
                         if(bytes_left)
                         {
@@ -748,6 +879,16 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
                         }
                         //read in loop till no data left
                     }while(bytes_left);
+                    if(dedup && !bytes_left)
+                    {
+                        //client has this selection now, remember it to not send it again
+                        pthread_mutex_lock(&remoteVars->selection_mutex);
+                        remoteVars->selstruct.lastSentValid[selection_from_atom(selection)]=TRUE;
+                        remoteVars->selstruct.lastSentCrc[selection_from_atom(selection)]=crc;
+                        remoteVars->selstruct.lastSentSize[selection_from_atom(selection)]=total_size;
+                        remoteVars->selstruct.lastSentType[selection_from_atom(selection)]=data_type;
+                        pthread_mutex_unlock(&remoteVars->selection_mutex);
+                    }
                 }
                 else
                 {
@@ -756,9 +897,13 @@ void read_selection_property(xcb_atom_t selection, xcb_atom_t property)
             }
             if(reply)
                 free(reply);
-            //if reading incr property this will say sel owner that we are ready for the next chunk of data
-            xcb_delete_property(remoteVars->selstruct.xcbConnection, remoteVars->selstruct.clipWinId, property);
-            xcb_flush(remoteVars->selstruct.xcbConnection);
+            //if reading incr property this will say sel owner that we are ready for the next chunk of data,
+            //paused property is deleted when send thread drains the queue
+            if(!paused)
+            {
+                xcb_delete_property(remoteVars->selstruct.xcbConnection, remoteVars->selstruct.clipWinId, property);
+                xcb_flush(remoteVars->selstruct.xcbConnection);
+            }
         }
     }
 }
@@ -780,7 +925,7 @@ void send_notify_to_client(xcb_atom_t selection, xcb_atom_t mime)
     chunk->totalSize=0;
     chunk->firstChunk=chunk->lastChunk=TRUE;
 
-    pthread_mutex_lock(&remoteVars->sendqueue_mutex);
+    pthread_mutex_lock(&remoteVars->selection_mutex);
 
     //attach chunk to the end of output chunk queue
     if(!remoteVars->selstruct.lastOutputChunk)
@@ -792,10 +937,9 @@ void send_notify_to_client(xcb_atom_t selection, xcb_atom_t mime)
         remoteVars->selstruct.lastOutputChunk->next=chunk;
         remoteVars->selstruct.lastOutputChunk=chunk;
     }
-    pthread_cond_signal(&remoteVars->have_sendqueue_cond);
-
+    pthread_mutex_unlock(&remoteVars->selection_mutex);
 
-    pthread_mutex_unlock(&remoteVars->sendqueue_mutex);
+    remote_wakeup_send_thread();
 }
 
 void process_selection_notify(xcb_generic_event_t *e)
@@ -815,6 +959,24 @@ void process_selection_notify(xcb_generic_event_t *e)
         return;
     }
 
+    if(sel_event->property==ATOM_INCR && sel_event->target==ATOM_INCR)
+    {
+        //send thread drained the queue of output chunks, continue reading of paused INCR property
+        xcb_atom_t property;
+
+        pthread_mutex_lock(&remoteVars->selection_mutex);
+        property=remoteVars->selstruct.incrPausedProperty;
+        remoteVars->selstruct.incrPausedProperty=0;
+        remoteVars->selstruct.incrResumeSent=FALSE;
+        pthread_mutex_unlock(&remoteVars->selection_mutex);
+        if(property && property == remoteVars->selstruct.incrAtom)
+        {
+            xcb_delete_property(remoteVars->selstruct.xcbConnection, remoteVars->selstruct.clipWinId, property);
+            xcb_flush(remoteVars->selstruct.xcbConnection);
+        }
+        return;
+    }
+
     if(sel_event->property== sel_event->selection && sel_event->target==sel_event->selection)
     {
         //have data ready from server. We don't need to do anything here. This event interrrupted the waiting procedure and the delayed requests are already processed
@@ -824,8 +986,7 @@ void process_selection_notify(xcb_generic_event_t *e)
 
     //processing the event which is reply for convert selection call
 
-    remoteVars->selstruct.incrAtom=0;
-    remoteVars->selstruct.incrementalSize=0;
+    cancel_incr_reading();
 
     if (sel_event->requestor != remoteVars->selstruct.clipWinId)
     {
@@ -870,7 +1031,7 @@ void process_property_notify(xcb_generic_event_t *e)
         {
             //we recieveing the selection data incrementally, let's read a next chunk
 //             EPHYR_DBG("reading incr property %d", pn->atom);
-            read_selection_property(remoteVars->selstruct.currentSelection, pn->atom);
+            read_selection_property(remoteVars->selstruct.incrSelection, pn->atom);
         }
     }
     if(pn->state==XCB_PROPERTY_DELETE)
@@ -904,12 +1065,18 @@ void process_selection_owner_notify(xcb_generic_event_t *e)
     }
 
     //cancel all previous incr reading
-    remoteVars->selstruct.incrementalSize=remoteVars->selstruct.incrementalSizeRead=0;
-    remoteVars->selstruct.incrAtom=0;
+    cancel_incr_reading();
 
 
     selection=selection_from_atom(notify_event->selection);
 
+    //drop the chunks of previous selection which are not sent yet
+    pthread_mutex_lock(&remoteVars->selection_mutex);
+    remove_output_selection(selection);
+    pthread_mutex_unlock(&remoteVars->selection_mutex);
+    //chunk which aborts the transfer could be added
+    remote_wakeup_send_thread();
+
     //we are not owners of this selction anymore
 
     pthread_mutex_lock(&remoteVars->selstruct.inMutex);
@@ -1092,6 +1259,25 @@ void client_sel_data_notify(enum SelectionType sel)
 }
 
 
+void selection_queue_drained_notify(void)
+{
+    //this function is used from send thread to notify selection thread
+    //that it can continue reading of paused INCR property
+    //selection_mutex should be locked by calling thread
+
+    xcb_selection_notify_event_t* event= (xcb_selection_notify_event_t*)calloc(32, 1);
+    event->response_type = XCB_SELECTION_NOTIFY;
+    event->requestor = remoteVars->selstruct.clipWinId;
+    event->selection = remoteVars->selstruct.currentSelection;
+    event->target    = ATOM_INCR;
+    event->property  = ATOM_INCR;
+    event->time      = XCB_TIME_CURRENT_TIME;
+
+    xcb_send_event(remoteVars->selstruct.xcbConnection, FALSE, remoteVars->selstruct.clipWinId, XCB_EVENT_MASK_NO_EVENT, (char*)event);
+    xcb_flush(remoteVars->selstruct.xcbConnection);
+    free(event);
+}
+
 BOOL process_selection_request(xcb_generic_event_t *e)
 {
     //processing selection request.
@@ -1198,6 +1384,172 @@ enum SelectionType selection_from_atom(xcb_atom_t selection)
 
 }
 
+static
+enum ImageFormat image_format(unsigned char* data, uint32_t size)
+{
+    //detect format of image file by signature
+    if(!data)
+        return IMAGE_UNKNOWN;
+    if(is_png(data, size))
+        return IMAGE_PNG;
+    if(size > 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+        return IMAGE_JPEG;
+    if(size > 54 && data[0] == 'B' && data[1] == 'M')
+        return IMAGE_BMP;
+    return IMAGE_UNKNOWN;
+}
+
+struct jpeg_decode_error
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static
+void jpeg_decode_error_exit(j_common_ptr cinfo)
+{
+    //don't let libjpeg exit on broken data from client
+    longjmp(((struct jpeg_decode_error*)cinfo->err)->jump, 1);
+}
+
+static
+unsigned char* jpeg_to_bgr(unsigned char* data, uint32_t size, uint32_t* width, uint32_t* height)
+{
+    //decode jpeg file to buffer with CACHEBPP bytes per pixel in BGR order, caller should free the buffer
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_decode_error jerr;
+    unsigned char* volatile out=NULL;
+    unsigned char* row;
+    uint32_t x;
+
+    cinfo.err=jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit=jpeg_decode_error_exit;
+    if(setjmp(jerr.jump))
+    {
+        EPHYR_DBG("failed to decode JPEG selection");
+        jpeg_destroy_decompress(&cinfo);
+        free(out);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space=JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if(cinfo.output_components != CACHEBPP || cinfo.output_width > MAX_CONVERT_IMAGE_SIZE || cinfo.output_height > MAX_CONVERT_IMAGE_SIZE ||
+       (uint64_t)cinfo.output_width * cinfo.output_height > MAX_CONVERT_IMAGE_PIXELS)
+    {
+        EPHYR_DBG("not supported JPEG selection: %dx%d, %d components", cinfo.output_width, cinfo.output_height, cinfo.output_components);
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
+    *width=cinfo.output_width;
+    *height=cinfo.output_height;
+    out=malloc((size_t)*width * *height * CACHEBPP);
+    if(!out)
+    {
+        EPHYR_DBG("failed to allocate %dx%d image for JPEG selection", *width, *height);
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
+    while(cinfo.output_scanline < cinfo.output_height)
+    {
+        row=out + (size_t)cinfo.output_scanline * *width * CACHEBPP;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        for(x=0; x < *width; ++x)
+        {
+            unsigned char r=row[x*CACHEBPP];
+            row[x*CACHEBPP]=row[x*CACHEBPP+2];
+            row[x*CACHEBPP+2]=r;
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return out;
+}
+
+static
+unsigned char* bmp_to_bgr(unsigned char* data, uint32_t size, uint32_t* width, uint32_t* height)
+{
+    //decode uncompressed 24 or 32 bits BMP file to buffer with CACHEBPP bytes per pixel in BGR order, caller should free the buffer
+    uint32_t offset=*((uint32_t*)(data+10));
+    int32_t w=*((int32_t*)(data+18));
+    int32_t h=*((int32_t*)(data+22));
+    uint16_t bpp=*((uint16_t*)(data+28));
+    uint32_t compression=*((uint32_t*)(data+30));
+    uint32_t stride, x, y, src_y;
+    BOOL bottom_up=(h > 0);
+    unsigned char* out;
+
+    if(h < 0)
+        h=-h;
+    if(compression != 0 || (bpp != 24 && bpp != 32) || w <= 0 || h == 0 || w > MAX_CONVERT_IMAGE_SIZE || h > MAX_CONVERT_IMAGE_SIZE ||
+       (uint64_t)w * h > MAX_CONVERT_IMAGE_PIXELS)
+    {
+        EPHYR_DBG("not supported BMP selection: %dx%d, %d bpp, compression %d", w, h, bpp, compression);
+        return NULL;
+    }
+    stride=((w * bpp / 8) + 3) & ~3;
+    if(offset > size || (uint64_t)stride * h > size - offset)
+    {
+        EPHYR_DBG("BMP selection is too short");
+        return NULL;
+    }
+    *width=w;
+    *height=h;
+    out=malloc((size_t)w * h * CACHEBPP);
+    if(!out)
+    {
+        EPHYR_DBG("failed to allocate %dx%d image for BMP selection", w, h);
+        return NULL;
+    }
+    for(y=0; y < *height; ++y)
+    {
+        src_y=bottom_up ? (*height - 1 - y) : y;
+        for(x=0; x < *width; ++x)
+        {
+            memcpy(out + ((size_t)y * *width + x) * CACHEBPP, data + offset + (size_t)src_y * stride + x * (bpp / 8), CACHEBPP);
+        }
+    }
+    return out;
+}
+
+static
+BOOL convert_selection_to_png(struct InputBuffer* selbuff)
+{
+    //convert image from client to PNG, converted image is stored in selection buffer till selection changes
+    //inmutex is locked in the caller function
+    unsigned char* bgr=NULL;
+    uint32_t width=0, height=0;
+
+    if(selbuff->pngData)
+        return TRUE;
+    switch(image_format(selbuff->data, selbuff->size))
+    {
+        case IMAGE_JPEG:
+            bgr=jpeg_to_bgr(selbuff->data, selbuff->size, &width, &height);
+            break;
+        case IMAGE_BMP:
+            bgr=bmp_to_bgr(selbuff->data, selbuff->size, &width, &height);
+            break;
+        default:
+            break;
+    }
+    if(!bgr)
+        return FALSE;
+    selbuff->pngData=png_compress(width, height, bgr, &selbuff->pngSize, FALSE);
+    free(bgr);
+    if(!selbuff->pngData || !selbuff->pngSize)
+    {
+        free(selbuff->pngData);
+        selbuff->pngData=NULL;
+        selbuff->pngSize=0;
+        return FALSE;
+    }
+    EPHYR_DBG("converted %dx%d image selection to PNG, %d bytes", width, height, selbuff->pngSize);
+    return TRUE;
+}
+
 void send_mime_types(xcb_selection_request_event_t* req)
 {
     //inmutex is locked in the caller function
@@ -1213,8 +1565,20 @@ void send_mime_types(xcb_selection_request_event_t* req)
 
     if(remoteVars->selstruct.inSelection[sel].mimeData==PIXMAP)
     {
-
-        //only supporting PNG here at the moment
+        //offer the format we got from client, it'll be sent without convertion
+        //PNG is offered always, other formats are converted to PNG on request
+        switch(image_format(remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size))
+        {
+            case IMAGE_JPEG:
+                targets[mcount++]=ATOM_IMAGE_JPEG;
+                targets[mcount++]=ATOM_IMAGE_JPG;
+                break;
+            case IMAGE_BMP:
+                targets[mcount++]=ATOM_IMAGE_BMP;
+                break;
+            default:
+                break;
+        }
         targets[mcount++]=ATOM_IMAGE_PNG;
 
 /*
@@ -1254,6 +1618,7 @@ xcb_atom_t send_data(xcb_selection_request_event_t* req)
     //inmutex is locked in the caller function
     //send data
     enum SelectionType sel=selection_from_atom(req->selection);
+    enum ImageFormat format;
 
 
     if(remoteVars->selstruct.inSelection[sel].mimeData==UTF_STRING)
@@ -1262,7 +1627,8 @@ xcb_atom_t send_data(xcb_selection_request_event_t* req)
         if(is_string_atom(req->target))
         {
 //             EPHYR_DBG("sending UTF text");
-            return set_data_property(req, remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size);
+            return set_data_property(req, remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size,
+                                     remoteVars->selstruct.inSelection[sel].spooled?remoteVars->selstruct.inSelection[sel].spoolFd:-1);
         }
         else
         {
@@ -1284,29 +1650,27 @@ xcb_atom_t send_data(xcb_selection_request_event_t* req)
             free(starget);
 */
 
-        //TODO: implement convertion between different image formats
-        if(is_png(remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size))
-        {
-            if(req->target!=ATOM_IMAGE_PNG)
-            {
-                EPHYR_DBG("unsupported property requested: %d",req->target);
-                return XCB_NONE;
-            }
-        }
-        else
+        format=image_format(remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size);
+        if(!((format == IMAGE_PNG && req->target == ATOM_IMAGE_PNG) ||
+             (format == IMAGE_JPEG && (req->target == ATOM_IMAGE_JPEG || req->target == ATOM_IMAGE_JPG)) ||
+             (format == IMAGE_BMP && req->target == ATOM_IMAGE_BMP)))
         {
-            if((req->target!=ATOM_IMAGE_JPEG)&&(req->target!=ATOM_IMAGE_JPG))
+            //requestor wants other format, only converting to PNG
+            if(req->target != ATOM_IMAGE_PNG || !convert_selection_to_png(&remoteVars->selstruct.inSelection[sel]))
             {
                 EPHYR_DBG("unsupported property requested: %d",req->target);
                 return XCB_NONE;
             }
+            return set_data_property(req, remoteVars->selstruct.inSelection[sel].pngData, remoteVars->selstruct.inSelection[sel].pngSize, -1);
         }
-        return set_data_property(req, remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size);
+        //sending original data of client
+        return set_data_property(req, remoteVars->selstruct.inSelection[sel].data, remoteVars->selstruct.inSelection[sel].size,
+                                 remoteVars->selstruct.inSelection[sel].spooled?remoteVars->selstruct.inSelection[sel].spoolFd:-1);
     }
     return XCB_NONE;
 }
 
-xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char* data, uint32_t size)
+xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char* data, uint32_t size, int spoolFd)
 {
     //inmutex locked in parent thread
     //set data to window property
@@ -1352,7 +1716,7 @@ xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char*
     xcb_change_property(remoteVars->selstruct.xcbConnection, XCB_PROP_MODE_REPLACE, req->requestor, req->property,
                         ATOM_INCR, 32, 1, (const void *)&size);
 
-    start_incr_transaction(req->requestor, req->property, req->target, data, size);
+    start_incr_transaction(req->requestor, req->property, req->target, data, size, spoolFd);
 
 
     xcb_flush(remoteVars->selstruct.xcbConnection);
@@ -1360,10 +1724,11 @@ xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char*
 }
 
 
-void start_incr_transaction(xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target, unsigned char* data, uint32_t size)
+void start_incr_transaction(xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target, unsigned char* data, uint32_t size, int spoolFd)
 {
     //creating INCR transaction
     //inmutex is locked from parent thread
+    //if data is spooled to file, transaction maps the same file instead of copying the data
 
     const uint32_t mask[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
 
@@ -1373,10 +1738,32 @@ void start_incr_transaction(xcb_window_t requestor, xcb_atom_t property, xcb_ato
     tr->target=target;
     tr->sentBytes=0;
     tr->timestamp=currentTime.milliseconds;
-    tr->data=malloc(size);
     tr->size=size;
     tr->next=NULL;
-    memcpy(tr->data, data, size);
+    tr->spoolReleased=0;
+    tr->spoolFd=-1;
+    tr->data=NULL;
+    if(spoolFd != -1)
+    {
+        //transaction has it's own descriptor and mapping, it can outlive input selection buffer
+        tr->spoolFd=dup(spoolFd);
+        if(tr->spoolFd != -1)
+        {
+            tr->data=mmap(NULL, size, PROT_READ, MAP_SHARED, tr->spoolFd, 0);
+            if(tr->data == MAP_FAILED)
+            {
+                EPHYR_DBG("failed to map selection spool file");
+                close(tr->spoolFd);
+                tr->spoolFd=-1;
+                tr->data=NULL;
+            }
+        }
+    }
+    if(!tr->data)
+    {
+        tr->data=malloc(size);
+        memcpy(tr->data, data, size);
+    }
 
     //add new transaction to the list
     if(!remoteVars->selstruct.firstIncrTransaction)
@@ -1410,24 +1797,43 @@ unsigned char* zcompress(unsigned char *inbuf, uint32_t size, uint32_t* compress
     //caller function should chek result of compression and free the output buffer
 
 
+    //deflate state is allocated once and reset for every chunk, it's used only from selection thread
+    static z_stream stream;
+    static int level=-1;
+    int rc;
+
+    if(level != remoteVars->selstruct.compressionLevel)
+    {
+        if(level != -1)
+            deflateEnd(&stream);
+        level=-1;
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        if(deflateInit(&stream, remoteVars->selstruct.compressionLevel) != Z_OK)
+        {
+            EPHYR_DBG("failed to init zlib stream");
+            *compress_size=0;
+            return NULL;
+        }
+        level=remoteVars->selstruct.compressionLevel;
+    }
+    else
+    {
+        deflateReset(&stream);
+    }
+
     //out buffer at least the size of input buffer
     unsigned char* out=malloc(size);
 
-    z_stream stream;
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-
     stream.avail_in = size;
     stream.next_in = inbuf;
     stream.avail_out = size;
     stream.next_out = out;
 
-    deflateInit(&stream, Z_BEST_COMPRESSION);
-    deflate(&stream, Z_FINISH);
-    deflateEnd(&stream);
+    rc=deflate(&stream, Z_FINISH);
 
-    if(!stream.total_out || stream.total_out >= size)
+    if(rc != Z_STREAM_END || !stream.total_out || stream.total_out >= size)
     {
         EPHYR_DBG("zlib compression failed");
         free(out);
@@ -1438,6 +1844,95 @@ unsigned char* zcompress(unsigned char *inbuf, uint32_t size, uint32_t* compress
     return out;
 }
 
+void alloc_selection_buffer(struct InputBuffer* selbuff, uint32_t size)
+{
+    //allocate buffer for incoming selection
+    //inmutex should be locked by calling thread
+    //big selections are written to unlinked temporary file which is mapped in memory,
+    //received data is released from memory by release_selection_buffer
+    char fname[PATH_MAX];
+    const char* tmpdir=getenv("TMPDIR");
+    struct statvfs fsinfo;
+    int fd, rc;
+    void* data=NULL;
+
+    selbuff->spooled=FALSE;
+    selbuff->spoolFd=-1;
+    selbuff->spoolReleased=0;
+
+    if(remoteVars->selstruct.spoolWindow && size > remoteVars->selstruct.spoolWindow)
+    {
+        snprintf(fname, PATH_MAX, "%s/x2gokdrive-selection-XXXXXX", tmpdir?tmpdir:"/tmp");
+        fd=mkstemp(fname);
+        if(fd == -1)
+        {
+            EPHYR_DBG("failed to create spool file %s", fname);
+        }
+        else
+        {
+            unlink(fname);
+            //size is coming from client, don't try to fill the disk
+            if(fstatvfs(fd, &fsinfo) || (unsigned long long)fsinfo.f_bavail*fsinfo.f_frsize < (unsigned long long)size*2)
+            {
+                EPHYR_DBG("not enough space in %s for selection of %u bytes", tmpdir?tmpdir:"/tmp", size);
+                close(fd);
+            }
+            //blocks of file should be allocated now, writing to sparse mapping on full disk will raise SIGBUS
+            else if((rc=posix_fallocate(fd, 0, size)))
+            {
+                EPHYR_DBG("failed to allocate spool file for selection of %u bytes: %s", size, strerror(rc));
+                close(fd);
+            }
+            else if((data=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+            {
+                EPHYR_DBG("failed to map spool file for selection of %u bytes", size);
+                close(fd);
+            }
+            else
+            {
+                EPHYR_DBG("spooling selection of %u bytes to file", size);
+                selbuff->data=data;
+                selbuff->spoolFd=fd;
+                selbuff->spooled=TRUE;
+                return;
+            }
+        }
+    }
+    selbuff->data=malloc(size);
+}
+
+void free_selection_buffer(struct InputBuffer* selbuff)
+{
+    //inmutex should be locked by calling thread
+    if(selbuff->spooled)
+    {
+        munmap(selbuff->data, selbuff->size);
+        close(selbuff->spoolFd);
+    }
+    else if(selbuff->data)
+    {
+        free(selbuff->data);
+    }
+    selbuff->data=NULL;
+    selbuff->spooled=FALSE;
+    selbuff->spoolFd=-1;
+    selbuff->spoolReleased=0;
+    if(selbuff->pngData)
+    {
+        free(selbuff->pngData);
+    }
+    selbuff->pngData=NULL;
+    selbuff->pngSize=0;
+}
+
+void release_selection_buffer(struct InputBuffer* selbuff)
+{
+    //inmutex should be locked by calling thread
+    if(!selbuff->spooled)
+        return;
+    release_spooled_data(selbuff->data, &selbuff->spoolReleased, selbuff->bytesReady);
+}
+
 void delay_selection_request( xcb_selection_request_event_t *request, xcb_selection_notify_event_t* event)
 {
     //delay the request for later processing when data will be ready
@@ -1464,12 +1959,11 @@ void delay_selection_request( xcb_selection_request_event_t *request, xcb_select
         //if we didn't request the data yet, let's do it now
 //         EPHYR_DBG("requesting data");
 
-        pthread_mutex_lock(&remoteVars->sendqueue_mutex);
+        pthread_mutex_lock(&remoteVars->selection_mutex);
         remoteVars->selstruct.requestSelection[sel] = TRUE;
-        pthread_cond_signal(&remoteVars->have_sendqueue_cond);
-
+        pthread_mutex_unlock(&remoteVars->selection_mutex);
 
-        pthread_mutex_unlock(&remoteVars->sendqueue_mutex);
+        remote_wakeup_send_thread();
         remoteVars->selstruct.inSelection[sel].state=REQUESTED;
 
     }
@@ -54,19 +54,24 @@ void send_mime_types(xcb_selection_request_event_t* req);
 enum SelectionType selection_from_atom(xcb_atom_t selection);
 xcb_atom_t atom_from_selection(enum SelectionType sel);
 xcb_atom_t send_data(xcb_selection_request_event_t* req);
-xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char* data, uint32_t size);
+xcb_atom_t set_data_property(xcb_selection_request_event_t* req, unsigned char* data, uint32_t size, int spoolFd);
 void client_sel_request_notify(enum SelectionType sel);
 void client_sel_data_notify(enum SelectionType sel);
+void selection_queue_drained_notify(void);
 BOOL is_png(unsigned char* data, uint32_t size);
 void delay_selection_request( xcb_selection_request_event_t *reqest, xcb_selection_notify_event_t* event);
 void process_delayed_requests(void);
 struct DelayedRequest* discard_delayed_request(struct DelayedRequest* d, struct DelayedRequest* prev);
 BOOL check_req_sanity(xcb_selection_request_event_t* req);
-void start_incr_transaction(xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target, unsigned char* data, uint32_t size);
+void start_incr_transaction(xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target, unsigned char* data, uint32_t size, int spoolFd);
 void process_incr_transaction_property(xcb_property_notify_event_t * pn);
 void destroy_incr_transaction(struct IncrTransaction* tr, struct IncrTransaction* prev);
 void remove_obsolete_incr_transactions( BOOL checkTs);
 
 unsigned char* zcompress(unsigned char *inbuf, uint32_t size, uint32_t* compress_size);
 
+void alloc_selection_buffer(struct InputBuffer* selbuff, uint32_t size);
+void free_selection_buffer(struct InputBuffer* selbuff);
+void release_selection_buffer(struct InputBuffer* selbuff);
+
 #endif /* X2GOKDRIVESELECTION_H */